@@ -78,6 +78,12 @@
 // *****************[ STK Prusa3D specific command constants ]*****************
 
 #define CMD_SET_UPLOAD_SIZE_PRUSA3D         0x71
+#define CMD_SET_WINDOW_PRUSA3D              0x72
+#define CMD_SET_BAUD_PRUSA3D                0x73
+#define CMD_PROGRAM_FLASH_LZ_PRUSA3D        0x74
+#define CMD_READ_PAGE_CRC_PRUSA3D           0x75
+#define CMD_VERIFY_CRC32_PRUSA3D            0x76
+#define CMD_DUMP_PRUSA3D                    0x77
 
 
 // *****************[ STK status constants ]***************************
@@ -112,6 +118,12 @@
 #define PARAM_RESET_POLARITY                0x9E
 #define PARAM_CONTROLLER_INIT               0x9F
 
+// *****************[ STK Prusa3D specific parameter constants ]***************
+#define PARAM_SKIPPED_PAGES_LOW_PRUSA3D     0xD0
+#define PARAM_SKIPPED_PAGES_HIGH_PRUSA3D    0xD1
+#define PARAM_SKIPPED_ERASES_LOW_PRUSA3D    0xD2
+#define PARAM_SKIPPED_ERASES_HIGH_PRUSA3D   0xD3
+
 // *****************[ STK answer constants ]***************************
 
 #define ANSWER_CKSUM_ERROR                  0xB0
@@ -9,6 +9,9 @@ Version:   1.11
 #include <avr/pgmspace.h>
 #include "lcd.h"
 #include <avr/sfr_defs.h>
+#if (LCD_QUEUE==1)
+  #include <avr/interrupt.h>
+#endif
 #if (USE_ADELAY_LIBRARY==1)
   #include "adelay.h"
 #else
@@ -50,6 +53,14 @@ Version:   1.11
   #error LCD_DISPLAYS is not defined or not valid.
 #endif
 
+#if (LCD_QUEUE==1 && (LCD_BITS!=4 || WAIT_MODE!=0 || LCD_DISPLAYS!=1))
+  #error LCD_QUEUE=1 requires LCD_BITS=4, WAIT_MODE=0 and one display.
+#endif
+
+#if (LCD_SHADOW==1 && (LCD_DISPLAYS!=1 || LCD_ROWS>4 || LCD_COLUMNS>20))
+  #error LCD_SHADOW=1 requires one display with up to 4 rows of 20 columns.
+#endif
+
 // Constants/Macros
 #define PIN(x) (*(&x - 2))           // Address of Data Direction Register of Port X
 #define DDR(x) (*(&x - 1))           // Address of Input Register of Port X
@@ -152,6 +163,30 @@ static unsigned char PrevCmdInvolvedAddressCounter=0;
 static unsigned char ActiveDisplay=1;
 #endif
 
+static uint8_t InitStep=0;                      // Next lcd_init_poll() step, 5=initialized
+
+#if LCD_QUEUE==1
+#define LCD_QUEUE_SIZE 64                       // Must be power of two
+#define LCD_QUEUE_RS   0x100                    // Queue entry flag: write data (RS=1)
+#define LCD_TICK_US    40                       // Timer2 period
+
+static volatile uint16_t Queue[LCD_QUEUE_SIZE] __attribute__ ((section (".noinit"))); // Bytes to write, LCD_QUEUE_RS for data
+static volatile uint8_t QueueHead=0;            // Next free entry
+static volatile uint8_t QueueTail=0;            // Entry being written
+static uint8_t QueueWait=0;                     // Ticks to wait before next nibble
+static uint8_t QueueLowNibble=0;                // 1=low nibble of tail entry is next
+#endif
+
+#if LCD_SHADOW==1
+#define LCD_CELLS (LCD_COLUMNS*LCD_ROWS)
+
+// Not cleared at startup (RAM of application may be copied to flash), see lcd_init_begin()
+static char Shadow[LCD_CELLS] __attribute__ ((section (".noinit")));          // Characters to be displayed
+static uint8_t Dirty[(LCD_CELLS+7)/8] __attribute__ ((section (".noinit")));  // Cells not yet sent to display
+static uint8_t Cursor=0;                        // DDRAM address of next lcd_putc()
+static uint8_t DisplayAddress=0xff;             // DDRAM address counter of display, 0xff=unknown
+#endif
+
 static inline void lcd_e_port_low()
 {
   #if (LCD_DISPLAYS>1)
@@ -383,15 +418,155 @@ uint8_t lcd_getc()
 
 #endif
 
+#if LCD_BITS==4
 /*************************************************************************
-Low-level function to write byte to LCD controller
+DB4-DB7 port mapping, generated at compile time from settings.h
+Data pins on the same port are written together by one masked write,
+table of the first pin on a port holds port bits of all data pins on
+that port for each nibble
+*************************************************************************/
+#define lcd_same_port(a,b) (&(a)==&(b))
+
+#define lcd_port_bits(port,n) \
+  (((lcd_same_port(port,LCD_DB4_PORT) && ((n)&1))?_BV(LCD_DB4_PIN):0) | \
+   ((lcd_same_port(port,LCD_DB5_PORT) && ((n)&2))?_BV(LCD_DB5_PIN):0) | \
+   ((lcd_same_port(port,LCD_DB6_PORT) && ((n)&4))?_BV(LCD_DB6_PIN):0) | \
+   ((lcd_same_port(port,LCD_DB7_PORT) && ((n)&8))?_BV(LCD_DB7_PIN):0))
+
+#define lcd_port_mask(port) lcd_port_bits(port,15)
+
+#define lcd_port_table(port) \
+  { lcd_port_bits(port,0),  lcd_port_bits(port,1),  lcd_port_bits(port,2),  lcd_port_bits(port,3),  \
+    lcd_port_bits(port,4),  lcd_port_bits(port,5),  lcd_port_bits(port,6),  lcd_port_bits(port,7),  \
+    lcd_port_bits(port,8),  lcd_port_bits(port,9),  lcd_port_bits(port,10), lcd_port_bits(port,11), \
+    lcd_port_bits(port,12), lcd_port_bits(port,13), lcd_port_bits(port,14), lcd_port_bits(port,15) }
+
+// Port not written by a previous data pin
+#define lcd_db5_first_on_port (!lcd_same_port(LCD_DB5_PORT,LCD_DB4_PORT))
+#define lcd_db6_first_on_port (!lcd_same_port(LCD_DB6_PORT,LCD_DB4_PORT) && \
+                               !lcd_same_port(LCD_DB6_PORT,LCD_DB5_PORT))
+#define lcd_db7_first_on_port (!lcd_same_port(LCD_DB7_PORT,LCD_DB4_PORT) && \
+                               !lcd_same_port(LCD_DB7_PORT,LCD_DB5_PORT) && \
+                               !lcd_same_port(LCD_DB7_PORT,LCD_DB6_PORT))
+
+// Tables are in RAM, bootloader can not read flash above 64K with LPM
+static const uint8_t NibbleDB4[16]=lcd_port_table(LCD_DB4_PORT);
+static const uint8_t NibbleDB5[16]=lcd_port_table(LCD_DB5_PORT);
+static const uint8_t NibbleDB6[16]=lcd_port_table(LCD_DB6_PORT);
+static const uint8_t NibbleDB7[16]=lcd_port_table(LCD_DB7_PORT);
+
+/*************************************************************************
+Output nibble on DB4-DB7, one write per port
+*************************************************************************/
+static inline void lcd_nibble_out(uint8_t nibble)
+  {
+    nibble&=0x0f;
+    LCD_DB4_PORT=(LCD_DB4_PORT & ~lcd_port_mask(LCD_DB4_PORT)) | NibbleDB4[nibble];
+    if (lcd_db5_first_on_port)
+      LCD_DB5_PORT=(LCD_DB5_PORT & ~lcd_port_mask(LCD_DB5_PORT)) | NibbleDB5[nibble];
+    if (lcd_db6_first_on_port)
+      LCD_DB6_PORT=(LCD_DB6_PORT & ~lcd_port_mask(LCD_DB6_PORT)) | NibbleDB6[nibble];
+    if (lcd_db7_first_on_port)
+      LCD_DB7_PORT=(LCD_DB7_PORT & ~lcd_port_mask(LCD_DB7_PORT)) | NibbleDB7[nibble];
+  }
+
+/*************************************************************************
+Output nibble on DB4-DB7 and pulse E
+*************************************************************************/
+static inline void lcd_nibble(uint8_t nibble)
+  {
+    lcd_nibble_out(nibble);
+
+    Delay_ns(100);
+    lcd_e_port_high();
+
+    Delay_ns(500);
+    lcd_e_port_low();
+  }
+#endif
+
+#if LCD_QUEUE==1
+/*************************************************************************
+Timer2 interrupt, writes one nibble of queued byte per tick, waits
+40us after each byte and 1640us after clear/home
+*************************************************************************/
+ISR(TIMER2_COMPA_vect)
+  {
+    uint16_t entry;
+
+    if (QueueWait)
+      {
+        QueueWait--;
+        return;
+      }
+    if (QueueTail==QueueHead)
+      {
+        TIMSK2=0;                                     // Queue empty, stop timer
+        TCCR2B=0;
+        return;
+      }
+    entry=Queue[QueueTail];
+    if (!QueueLowNibble)
+      {
+        if (entry & LCD_QUEUE_RS)
+          lcd_rs_port_high();                         // RS=1: Write Character
+        else lcd_rs_port_low();                       // RS=0: Write Command
+        lcd_nibble(entry>>4);
+        QueueLowNibble=1;
+      }
+    else
+      {
+        lcd_nibble(entry);
+        QueueLowNibble=0;
+        QueueTail=(QueueTail+1)&(LCD_QUEUE_SIZE-1);
+        if (!(entry & LCD_QUEUE_RS) && (uint8_t)entry<=((1<<LCD_CLR) | (1<<LCD_HOME)))
+          QueueWait=1640/LCD_TICK_US;                 // clrscr or home
+      }
+  }
+
+/*************************************************************************
+Wait until all queued bytes are written and stop Timer2
+Input:    none
+Returns:  none
+*************************************************************************/
+void lcd_sync()
+  {
+    while (TIMSK2 & _BV(OCIE2A))
+      ;
+    TCCR2A=0;                                         // Timer2 back to reset state
+    OCR2A=0;
+    TCNT2=0;
+    TIFR2=_BV(OCF2A);
+  }
+#endif
+
+/*************************************************************************
+Low-level function to write byte to LCD controller, without execution delay
 Input:    data   byte to write to LCD
           rs     1: write data
                  0: write instruction
 Returns:  none
 *************************************************************************/
-static void lcd_write(uint8_t data,uint8_t rs)
+static void lcd_write_nowait(uint8_t data,uint8_t rs)
   {
+    #if LCD_QUEUE==1
+      uint16_t entry=rs?(data | LCD_QUEUE_RS):data;
+      uint8_t head=(QueueHead+1)&(LCD_QUEUE_SIZE-1);
+
+      while (head==QueueTail)                         // Wait for free entry
+        ;
+      Queue[QueueHead]=entry;
+      QueueHead=head;
+      if (!(TIMSK2 & _BV(OCIE2A)))                    // Start timer, interrupt stops it when queue is empty
+        {
+          OCR2A=(F_CPU/8/1000000*LCD_TICK_US)-1;
+          TCCR2A=_BV(WGM21);                          // CTC
+          TCNT2=0;
+          TIFR2=_BV(OCF2A);
+          TCCR2B=_BV(CS21);                           // F_CPU/8
+          TIMSK2=_BV(OCIE2A);
+        }
+    #else
     #if (WAIT_MODE==1 && RW_LINE_IMPLEMENTED==1)
       lcd_waitbusy();
       if (PrevCmdInvolvedAddressCounter)
@@ -417,32 +592,10 @@ static void lcd_write(uint8_t data,uint8_t rs)
       }
 
     #if LCD_BITS==4
-      lcd_db7_port_set(data&_BV(7));                  //Output High Nibble
-      lcd_db6_port_set(data&_BV(6));
-      lcd_db5_port_set(data&_BV(5));
-      lcd_db4_port_set(data&_BV(4));
-
-      Delay_ns(100);
-      lcd_e_port_high();
-
-      Delay_ns(500);
-      lcd_e_port_low();
-
-      lcd_db7_port_set(data&_BV(3));                  //Output High Nibble
-      lcd_db6_port_set(data&_BV(2));
-      lcd_db5_port_set(data&_BV(1));
-      lcd_db4_port_set(data&_BV(0));
-
-      Delay_ns(100);
-      lcd_e_port_high();
-
-      Delay_ns(500);
-      lcd_e_port_low();
+      lcd_nibble(data>>4);                            //Output High Nibble
+      lcd_nibble(data);                               //Output Low Nibble
 
-      lcd_db7_port_high();                            // All Data Pins High (Inactive)
-      lcd_db6_port_high();
-      lcd_db5_port_high();
-      lcd_db4_port_high();
+      lcd_nibble_out(0x0f);                           // All Data Pins High (Inactive)
 
     #else //using 8-Bit_Mode
       lcd_db7_port_set(data&_BV(7));                  //Output High Nibble
@@ -468,14 +621,102 @@ static void lcd_write(uint8_t data,uint8_t rs)
       lcd_db1_port_high();
       lcd_db0_port_high();
     #endif
+    #endif
+  }
 
-    #if (WAIT_MODE==0 || RW_LINE_IMPLEMENTED==0)
+/*************************************************************************
+Low-level function to write byte to LCD controller
+Input:    data   byte to write to LCD
+          rs     1: write data
+                 0: write instruction
+Returns:  none
+*************************************************************************/
+static void lcd_write(uint8_t data,uint8_t rs)
+  {
+    lcd_write_nowait(data,rs);
+
+    #if (LCD_QUEUE==0 && (WAIT_MODE==0 || RW_LINE_IMPLEMENTED==0))
       if (!rs && data<=((1<<LCD_CLR) | (1<<LCD_HOME))) // Is command clrscr or home?
         Delay_us(1640);
       else Delay_us(40);
     #endif
   }
 
+#if LCD_SHADOW==1
+/*************************************************************************
+DDRAM address to cell index (row 0 = 0x00, 1 = 0x40, 2 = 0x00+LCD_COLUMNS,
+3 = 0x40+LCD_COLUMNS)
+Input:    DDRAM address
+Returns:  cell index, 0xff if address is not shown
+*************************************************************************/
+static uint8_t lcd_cell(uint8_t address)
+  {
+    uint8_t row=(address & 0x40)?1:0;
+
+    address&=~0x40;
+    if (address>=LCD_COLUMNS)
+      {
+        address-=LCD_COLUMNS;
+        row+=2;
+      }
+    if (address>=LCD_COLUMNS || row>=LCD_ROWS)
+      return 0xff;
+    return row*LCD_COLUMNS+address;
+  }
+
+/*************************************************************************
+DDRAM address after character write (2 line mode)
+*************************************************************************/
+static uint8_t lcd_next(uint8_t address)
+  {
+    address++;
+    if (address==0x28)
+      return 0x40;
+    if (address==0x68)
+      return 0x00;
+    return address;
+  }
+
+/*************************************************************************
+Write character to display at DDRAM address, cursor is moved only if needed
+*************************************************************************/
+static void lcd_write_at(uint8_t address,char c)
+  {
+    if (DisplayAddress!=address)
+      lcd_write((1<<LCD_DDRAM)+address,0);
+    lcd_write(c,1);
+    DisplayAddress=lcd_next(address);
+  }
+
+/*************************************************************************
+Send changed characters to display, in DDRAM order to save cursor moves
+Input:    none
+Returns:  none
+*************************************************************************/
+void lcd_flush()
+  {
+    static const uint8_t RowAddress[4]={0x00,0x00+LCD_COLUMNS,0x40,0x40+LCD_COLUMNS};
+    uint8_t r,col;
+
+    if (InitStep<5)
+      return;                                       // Display not initialized yet
+    for (r=0;r<4;r++)
+      {
+        uint8_t address=RowAddress[r];
+        uint8_t cell=lcd_cell(address);
+
+        if (cell==0xff)
+          continue;
+        for (col=0;col<LCD_COLUMNS;col++,cell++,address++)
+          if (Dirty[cell>>3] & _BV(cell&7))
+            {
+              Dirty[cell>>3]&=~_BV(cell&7);
+              lcd_write_at(address,Shadow[cell]);
+            }
+      }
+  }
+#endif
+
 /*************************************************************************
 Send LCD controller instruction command
 Input:   instruction to send to LCD controller, see HD44780 data sheet
@@ -484,6 +725,9 @@ Returns: none
 void lcd_command(uint8_t cmd)
   {
     lcd_write(cmd,0);
+    #if LCD_SHADOW==1
+      DisplayAddress=0xff;                          // Command may move cursor
+    #endif
   }
 
 /*************************************************************************
@@ -493,7 +737,11 @@ Returns:  none
 *************************************************************************/
 void lcd_goto(uint8_t pos)
   {
-    lcd_command((1<<LCD_DDRAM)+pos);
+    #if LCD_SHADOW==1
+      Cursor=pos;
+    #else
+      lcd_command((1<<LCD_DDRAM)+pos);
+    #endif
   }
 
 
@@ -504,7 +752,19 @@ Returns:  none
 *************************************************************************/
 void lcd_clrscr()
   {
-    lcd_command(1<<LCD_CLR);
+    #if LCD_SHADOW==1
+      uint8_t cell;
+
+      for (cell=0;cell<LCD_CELLS;cell++)
+        if (Shadow[cell]!=' ')
+          {
+            Shadow[cell]=' ';
+            Dirty[cell>>3]|=_BV(cell&7);
+          }
+      Cursor=0;
+    #else
+      lcd_command(1<<LCD_CLR);
+    #endif
   }
 
 
@@ -515,7 +775,11 @@ Returns:  none
 *************************************************************************/
 void lcd_home()
   {
-    lcd_command(1<<LCD_HOME);
+    #if LCD_SHADOW==1
+      Cursor=0;
+    #else
+      lcd_command(1<<LCD_HOME);
+    #endif
   }
 
 
@@ -526,7 +790,20 @@ Returns:  none
 *************************************************************************/
 void lcd_putc(char c)
   {
-    lcd_write(c,1);
+    #if LCD_SHADOW==1
+      uint8_t cell=lcd_cell(Cursor);
+
+      if (cell==0xff)
+        lcd_write_at(Cursor,c);                     // Not shown address, write through
+      else if (Shadow[cell]!=c)
+        {
+          Shadow[cell]=c;
+          Dirty[cell>>3]|=_BV(cell&7);
+        }
+      Cursor=lcd_next(Cursor);
+    #else
+      lcd_write(c,1);
+    #endif
   }
 
 
@@ -558,12 +835,25 @@ void lcd_puts_P(const char *progmem_s)
   }
 
 /*************************************************************************
-Initialize display
+Start display initialization, lcd_init_poll() has to be called after
+the returned delay
 Input:    none
-Returns:  none
+Returns:  delay in ms before first lcd_init_poll() call
 *************************************************************************/
-void lcd_init()
+uint8_t lcd_init_begin()
   {
+    InitStep=0;
+    #if LCD_SHADOW==1
+      {
+        uint8_t cell;
+
+        for (cell=0;cell<LCD_CELLS;cell++)
+          Shadow[cell]=0;                           // 0=not written yet
+        for (cell=0;cell<sizeof(Dirty);cell++)
+          Dirty[cell]=0;
+      }
+    #endif
+
     //Set All Pins as Output
     lcd_e_ddr_high();
     lcd_rs_ddr_high();
@@ -601,23 +891,67 @@ void lcd_init()
     #endif
 
     //Startup Delay
-    Delay_ms(DELAY_RESET);
-
-    //Initialize Display
-    lcd_db7_port_low();
-    lcd_db6_port_low();
-    Delay_ns(100);
-    lcd_e_port_high();
-    Delay_ns(500);
-    lcd_e_port_low();
-
-    Delay_us(4100);
-
-    lcd_e_port_high();
-    Delay_ns(500);
-    lcd_e_port_low();
+    return DELAY_RESET;
+  }
 
-    Delay_us(100);
+/*************************************************************************
+Next step of display initialization
+Input:    none
+Returns:  delay in ms before next call, 0 when display is initialized
+*************************************************************************/
+uint8_t lcd_init_poll()
+  {
+    switch (InitStep++)
+      {
+        case 0 :
+          //Initialize Display
+          lcd_db7_port_low();
+          lcd_db6_port_low();
+          Delay_ns(100);
+          lcd_e_port_high();
+          Delay_ns(500);
+          lcd_e_port_low();
+          return 5;                                   // >= 4.1ms
+
+        case 1 :
+          lcd_e_port_high();
+          Delay_ns(500);
+          lcd_e_port_low();
+          return 1;                                   // >= 100us
+
+        case 2 :
+          break;                                      // function set below
+
+        case 3 :
+          //Display Clear
+          lcd_write_nowait(1<<LCD_CLR,0);
+          #if LCD_SHADOW==1
+            {
+              uint8_t cell;
+
+              for (cell=0;cell<LCD_CELLS;cell++)
+                if (Shadow[cell]!=' ' && Shadow[cell]!=0)
+                  Dirty[cell>>3]|=_BV(cell&7);     // Written before init, send after clear
+                else
+                  {
+                    Shadow[cell]=' ';
+                    Dirty[cell>>3]&=~_BV(cell&7);
+                  }
+              DisplayAddress=0;
+            }
+          #endif
+          return 2;                                   // >= 1.64ms
+
+        case 4 :
+          //Entry Mode Set
+          lcd_command(_BV(LCD_ENTRY_MODE) | _BV(LCD_ENTRY_INC));
+
+          //Display On
+          lcd_command(_BV(LCD_DISPLAYMODE) | _BV(LCD_DISPLAYMODE_ON));
+          //fall thru
+        default :
+          return 0;
+      }
 
     lcd_e_port_high();
     Delay_ns(500);
@@ -697,15 +1031,24 @@ void lcd_init()
 
     //Display Off
     lcd_command(_BV(LCD_DISPLAYMODE));
+    return 1;
+  }
 
-    //Display Clear
-    lcd_clrscr();
-
-    //Entry Mode Set
-    lcd_command(_BV(LCD_ENTRY_MODE) | _BV(LCD_ENTRY_INC));
+/*************************************************************************
+Initialize display
+Input:    none
+Returns:  none
+*************************************************************************/
+void lcd_init()
+  {
+    uint8_t ms=lcd_init_begin();
 
-    //Display On
-    lcd_command(_BV(LCD_DISPLAYMODE) | _BV(LCD_DISPLAYMODE_ON));
+    while (ms)
+      {
+        while (ms--)
+          Delay_ms(1);
+        ms=lcd_init_poll();
+      }
   }
 
 #if (LCD_DISPLAYS>1)
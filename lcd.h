@@ -44,6 +44,8 @@ Version:   1.11
 
 
 void lcd_init();
+uint8_t lcd_init_begin();
+uint8_t lcd_init_poll();
 void lcd_command(uint8_t cmd);
 
 void lcd_clrscr();
@@ -58,6 +60,18 @@ void lcd_putc(char c);
 void lcd_puts(const char *s);
 void lcd_puts_P(const char *progmem_s);
 
+#if LCD_SHADOW==1
+void lcd_flush();
+#else
+#define lcd_flush()
+#endif
+
+#if LCD_QUEUE==1
+void lcd_sync();
+#else
+#define lcd_sync()
+#endif
+
 #if (LCD_DISPLAYS>1)
 void lcd_use_display(int ADisplay);
 #endif
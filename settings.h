@@ -5,12 +5,23 @@
 
 #define EINSYBOARD
 
+// Boot policy EEPROM override (FAST_BOOT): policy byte followed by its complement at this
+// address, both bytes must be reserved for the bootloader by the application.
+// Not set = no override. Do not use the last two bytes, Prusa firmware keeps
+// EEPROM_LANG (4094) and EEPROM_SILENT (4095) there.
+//#define BOOT_POLICY_EEPROM       0x0000
+
 #define USE_ADELAY_LIBRARY       0           // Set to 1 to use my ADELAY library, 0 to use internal delay functions
 #define LCD_BITS                 4           // 4 for 4 Bit I/O Mode, 8 for 8 Bit I/O Mode
 #define RW_LINE_IMPLEMENTED      0           // 0 for no RW line (RW on LCD tied to ground), 1 for RW line present
 #define WAIT_MODE                0           // 0=Use Delay Method (Faster if running <10Mhz)
 // 1=Use Check Busy Flag (Faster if running >10Mhz) ***Requires RW Line***
 #define DELAY_RESET              15          // in mS
+#define LCD_SHADOW               0           // 1=Writes go to RAM copy of display, lcd_flush() sends changed characters
+#define LCD_COLUMNS              20          // Display size, only used for LCD_SHADOW
+#define LCD_ROWS                 4
+#define LCD_QUEUE                0           // 1=Writes are queued and sent by Timer2 interrupt, one nibble per 40us
+                                             // ***Requires LCD_BITS=4, WAIT_MODE=0 and enabled interrupts***
 
 #if (LCD_BITS==8)                            // If using 8 bit mode, you must configure DB0-DB7
 #define LCD_DB0_PORT           PORTC
@@ -99,12 +99,55 @@ LICENSE:
 //************************************************************************
 //*	Issue 181: added watch dog timmer support
 #define	_FIX_ISSUE_181_
+//************************************************************************
+//*	Features commented out below (//#define) are optional, they stay off until the
+//*	image with them is built and checked by 'make sizecheck ramcheck' (8K boot section,
+//*	RAM below the mailbox)
+// Boot path selected by reset cause (BOOT_POLICY, EEPROM override), bootloader waits
+// for host when requested by application (BOOT_APP_FLG_RUN) or by policy
+//#define FAST_BOOT
 // LCD startup screen and boot animation
 #define LCD_HD44780
 #define LCD_HD44780_ANIMATION
 #define LCD_HD44780_COUNTER
+//#define LCD_HD44780_RATE	// upload speed in KB/s and remaining time under progress (requires LCD_HD44780_COUNTER, TIMER_CLOCK)
+//#define LCD_HD44780_ASYNC_INIT	// LCD is initialized step by step while waiting for host (requires TIMER_CLOCK)
 // Dual serial support
 #define DUALSERIAL
+// Interrupt driven receive ring buffer (DUALSERIAL only)
+//#define SERIAL_RX_BUFFER
+// Interrupt driven transmit ring buffer (requires SERIAL_RX_BUFFER)
+//#define SERIAL_TX_BUFFER
+// Millisecond clock (Timer0) for boot window, receive timeout and LED blink (requires SERIAL_RX_BUFFER)
+//#define TIMER_CLOCK
+// Asynchronous flash programming, page is erased/written while next frame is received (requires SERIAL_RX_BUFFER)
+//#define SPM_ASYNC
+// Skip erase and write of pages equal to flash content (requires SPM_ASYNC)
+//#define SPM_SKIP_EQUAL
+// Skip page erase when new data only clears bits of flash content (requires SPM_SKIP_EQUAL)
+//#define SPM_SKIP_ERASE
+// Flash data of one page frames is received straight to the SPM page buffer (requires SPM_ASYNC)
+//#define SPM_ZERO_COPY
+// Program/read frames carrying up to MSG_BUFFER_PAGES flash pages
+//#define MULTI_PAGE_FRAMES
+// Flash read answer is sent straight from flash, not staged in message buffer
+//#define STREAM_READ
+// Sliding window mode, host may send more frames before answer (requires SERIAL_RX_BUFFER)
+//#define PIPELINE_WINDOW
+// Baudrate switch requested by host after sign on (DUALSERIAL only)
+//#define BAUD_SWITCH
+// LZSS compressed flash upload (requires SPM_ASYNC)
+//#define LZ_UPLOAD
+// CRC-16 digest per flash page, host sends only changed pages
+//#define PAGE_CRC
+// CRC-32 verify of flash range on device instead of read back
+//#define VERIFY_CRC32
+// EEPROM byte is written only when changed, with erase-only/write-only mode when possible
+//#define EEPROM_SPLIT_WRITE
+// EEPROM writes are queued and done by EE_READY interrupt (requires EEPROM_SPLIT_WRITE, SPM_ASYNC)
+//#define EEPROM_QUEUE
+// Compressed dump of flash or EEPROM range in one command (requires STREAM_READ)
+//#define DUMP_RANGE
 // EINSY board
 #define EINSYBOARD
 
@@ -117,7 +160,9 @@ LICENSE:
 #include	<util/delay.h>
 #include	<avr/eeprom.h>
 #include	<avr/common.h>
+#include	<util/crc16.h>
 #include	"command.h"
+#include	"settings.h"		// board settings, LCD pins, BOOT_POLICY_EEPROM
 
 #ifdef LCD_HD44780
 #include    "lcd.h"
@@ -225,6 +270,15 @@ LICENSE:
 	#define PROGLED_PIN		PING2
 #endif
 
+/*
+ * toggle LED, LCD interrupt (LCD_QUEUE) writes the same ports, read-modify-write must not be interrupted
+ */
+#if defined(LCD_HD44780) && (LCD_QUEUE == 1)
+	#define PROGLED_TOGGLE()	do { cli(); PROGLED_PORT ^= (1<<PROGLED_PIN); sei(); } while (0)
+#else
+	#define PROGLED_TOGGLE()	PROGLED_PORT ^= (1<<PROGLED_PIN)
+#endif
+
 
 
 /*
@@ -235,6 +289,24 @@ LICENSE:
 #endif
 
 #define	_BLINK_LOOP_COUNT_	(F_CPU / 2250)
+
+#ifdef TIMER_CLOCK
+/*
+ * Timeouts in milliseconds
+ */
+#ifndef BOOT_WINDOW_MS
+	#ifdef BLINK_LED_WHILE_WAITING
+		#define	BOOT_WINDOW_MS	1000	// wait for host after reset
+	#else
+		#define	BOOT_WINDOW_MS	7000
+	#endif
+#endif
+#ifndef RX_TIMEOUT_MS
+	#define	RX_TIMEOUT_MS		5000	// no byte from host, start application
+#endif
+#define	BLINK_PERIOD_MS			250		// LED toggle while waiting for host
+#define	BAUD_FALLBACK_MS		1000	// no valid frame after baudrate switch
+#endif //TIMER_CLOCK
 /*
  * UART Baudrate, AVRStudio AVRISP only accepts 115200 bps
  */
@@ -323,6 +395,7 @@ LICENSE:
 	#define	UART_ENABLE_RECEIVER		RXEN1
 	#define	UART_TRANSMIT_COMPLETE		TXC1
 	#define	UART_RECEIVE_COMPLETE		RXC1
+	#define	UART_DATA_REG_EMPTY			UDRE1
 	#define	UART_DATA_REG				UDR1
 	#define	UART_DOUBLE_SPEED			U2X1
 
@@ -336,6 +409,7 @@ LICENSE:
 	#define	UART_ENABLE_RECEIVER		RXEN
 	#define	UART_TRANSMIT_COMPLETE		TXC
 	#define	UART_RECEIVE_COMPLETE		RXC
+	#define	UART_DATA_REG_EMPTY			UDRE
 	#define	UART_DATA_REG				UDR
 	#define	UART_DOUBLE_SPEED			U2X
 
@@ -349,6 +423,7 @@ LICENSE:
 	#define	UART_ENABLE_RECEIVER		RXEN0
 	#define	UART_TRANSMIT_COMPLETE		TXC0
 	#define	UART_RECEIVE_COMPLETE		RXC0
+	#define	UART_DATA_REG_EMPTY			UDRE0
 	#define	UART_DATA_REG				UDR0
 	#define	UART_DOUBLE_SPEED			U2X0
 #elif defined(UBRR0L) && defined(UCSR0A) && defined(TXEN0)
@@ -360,6 +435,7 @@ LICENSE:
 	#define	UART_ENABLE_RECEIVER		RXEN0
 	#define	UART_TRANSMIT_COMPLETE		TXC0
 	#define	UART_RECEIVE_COMPLETE		RXC0
+	#define	UART_DATA_REG_EMPTY			UDRE0
 	#define	UART_DATA_REG				UDR0
 	#define	UART_DOUBLE_SPEED			U2X0
 #elif defined(UBRRL) && defined(UCSRA) && defined(UCSRB) && defined(TXEN) && defined(RXEN)
@@ -371,6 +447,7 @@ LICENSE:
 	#define	UART_ENABLE_RECEIVER		RXEN
 	#define	UART_TRANSMIT_COMPLETE		TXC
 	#define	UART_RECEIVE_COMPLETE		RXC
+	#define	UART_DATA_REG_EMPTY			UDRE
 	#define	UART_DATA_REG				UDR
 	#define	UART_DOUBLE_SPEED			U2X
 #else
@@ -395,27 +472,220 @@ LICENSE:
 
 // UART defines
 #define	UART_BAUD_RATE_LOW0			UBRR0L
+#define	UART_BAUD_RATE_HIGH0		UBRR0H
 #define	UART_STATUS_REG0			UCSR0A
 #define	UART_CONTROL_REG0			UCSR0B
 #define	UART_ENABLE_TRANSMITTER0	TXEN0
 #define	UART_ENABLE_RECEIVER0		RXEN0
 #define	UART_TRANSMIT_COMPLETE0		TXC0
 #define	UART_RECEIVE_COMPLETE0		RXC0
+#define	UART_DATA_REG_EMPTY0		UDRE0
 #define	UART_DATA_REG0				UDR0
 #define	UART_DOUBLE_SPEED0			U2X0
 
 #define	UART_BAUD_RATE_LOW2			UBRR2L
+#define	UART_BAUD_RATE_HIGH2		UBRR2H
 #define	UART_STATUS_REG2			UCSR2A
 #define	UART_CONTROL_REG2			UCSR2B
 #define	UART_ENABLE_TRANSMITTER2	TXEN2
 #define	UART_ENABLE_RECEIVER2		RXEN2
 #define	UART_TRANSMIT_COMPLETE2		TXC2
 #define	UART_RECEIVE_COMPLETE2		RXC2
+#define	UART_DATA_REG_EMPTY2		UDRE2
 #define	UART_DATA_REG2				UDR2
 #define	UART_DOUBLE_SPEED2			U2X2
 
 #endif //DUALSERIAL
 
+#if defined(SERIAL_RX_BUFFER) && !defined(DUALSERIAL)
+	#error "SERIAL_RX_BUFFER requires DUALSERIAL"
+#endif
+
+#if defined(PIPELINE_WINDOW) && !defined(SERIAL_RX_BUFFER)
+	#error "PIPELINE_WINDOW requires SERIAL_RX_BUFFER"
+#endif
+
+#ifdef SERIAL_RX_BUFFER
+/*
+ * Receive ring buffer filled by USART0/USART2 RX interrupts,
+ * size must be a power of two
+ */
+#ifndef SERIAL_RX_BUFFER_SIZE
+	#ifdef PIPELINE_WINDOW
+		#define SERIAL_RX_BUFFER_SIZE	2048	// space for PIPELINE_WINDOW_MAX (7) frames in flight
+	#else
+		#define SERIAL_RX_BUFFER_SIZE	256
+	#endif
+#endif
+#define SERIAL_RX_BUFFER_MASK	(SERIAL_RX_BUFFER_SIZE - 1)
+
+#if (SERIAL_RX_BUFFER_SIZE & SERIAL_RX_BUFFER_MASK)
+	#error "SERIAL_RX_BUFFER_SIZE must be a power of two"
+#endif
+#endif //SERIAL_RX_BUFFER
+
+/*
+ * Message buffer size, one page frame + header when MULTI_PAGE_FRAMES is not defined
+ */
+#ifdef MULTI_PAGE_FRAMES
+	#ifndef MSG_BUFFER_PAGES
+		#define MSG_BUFFER_PAGES	8
+	#endif
+#else
+	#define MSG_BUFFER_PAGES		1
+#endif
+#define MSG_BUFFER_SIZE			((MSG_BUFFER_PAGES * SPM_PAGESIZE) + 29)
+
+#ifdef PIPELINE_WINDOW
+/*
+ * In window mode messages are limited to one page frame (CMD_PROGRAM_FLASH_ISP with 10 byte header),
+ * longer frames are refused, so the window frames (+6 bytes framing each) always fit to the receive buffer
+ */
+#define PIPELINE_MSG_MAX		(SPM_PAGESIZE + 10)
+#define PIPELINE_WINDOW_MAX		(SERIAL_RX_BUFFER_SIZE / (PIPELINE_MSG_MAX + 6))
+
+#if (PIPELINE_WINDOW_MAX < 4)
+	#error "SERIAL_RX_BUFFER_SIZE too small for PIPELINE_WINDOW"
+#endif
+#endif //PIPELINE_WINDOW
+
+#if defined(BAUD_SWITCH) && !defined(DUALSERIAL)
+	#error "BAUD_SWITCH requires DUALSERIAL"
+#endif
+
+#ifdef BAUD_SWITCH
+/*
+ * Receive loop iterations without valid frame after baudrate switch,
+ * then bootloader falls back to BAUDRATE (about 1 second),
+ * with TIMER_CLOCK only a flag, timeout is BAUD_FALLBACK_MS
+ */
+#ifdef TIMER_CLOCK
+	#define	BAUD_FALLBACK_COUNT		1
+#else
+	#define	BAUD_FALLBACK_COUNT		(F_CPU >> 5)
+#endif
+#endif //BAUD_SWITCH
+
+#if defined(LCD_HD44780) && (LCD_QUEUE == 1) && !defined(SERIAL_RX_BUFFER)
+	#error "LCD_QUEUE requires SERIAL_RX_BUFFER (interrupts enabled, vectors in bootloader section)"
+#endif
+
+#if defined(LCD_HD44780_ASYNC_INIT) && (!defined(LCD_HD44780) || !defined(TIMER_CLOCK))
+	#error "LCD_HD44780_ASYNC_INIT requires LCD_HD44780 and TIMER_CLOCK"
+#endif
+
+#if defined(LCD_HD44780_RATE) && (!defined(LCD_HD44780_COUNTER) || !defined(TIMER_CLOCK))
+	#error "LCD_HD44780_RATE requires LCD_HD44780_COUNTER and TIMER_CLOCK"
+#endif
+
+#ifdef LCD_HD44780_RATE
+	#define	RATE_PERIOD_MS		1000	// upload speed measuring period
+#endif
+
+#if defined(FAST_BOOT) && !defined(_FIX_ISSUE_181_)
+	#error "FAST_BOOT requires _FIX_ISSUE_181_"
+#endif
+
+#if defined(TIMER_CLOCK) && !defined(SERIAL_RX_BUFFER)
+	#error "TIMER_CLOCK requires SERIAL_RX_BUFFER"
+#endif
+
+#if defined(SERIAL_TX_BUFFER) && !defined(SERIAL_RX_BUFFER)
+	#error "SERIAL_TX_BUFFER requires SERIAL_RX_BUFFER"
+#endif
+
+#ifdef SERIAL_TX_BUFFER
+/*
+ * Transmit ring buffer drained by USART0/USART2 UDRE interrupts,
+ * size must be a power of two and not bigger than 256
+ */
+#ifndef SERIAL_TX_BUFFER_SIZE
+	#define SERIAL_TX_BUFFER_SIZE	128
+#endif
+#define SERIAL_TX_BUFFER_MASK	(SERIAL_TX_BUFFER_SIZE - 1)
+
+#if (SERIAL_TX_BUFFER_SIZE & SERIAL_TX_BUFFER_MASK) || (SERIAL_TX_BUFFER_SIZE > 256)
+	#error "SERIAL_TX_BUFFER_SIZE must be a power of two <= 256"
+#endif
+#endif //SERIAL_TX_BUFFER
+
+#if defined(SPM_ASYNC) && !defined(SERIAL_RX_BUFFER)
+	#error "SPM_ASYNC requires SERIAL_RX_BUFFER"
+#endif
+
+#ifdef SPM_ASYNC
+/*
+ * Number of RAM page buffers queued for the SPM engine
+ */
+#ifndef SPM_PAGE_BUFFERS
+	#define SPM_PAGE_BUFFERS	2
+#endif
+
+/*
+ * States of the SPM engine
+ */
+#define	SPM_STATE_IDLE		0
+#define	SPM_STATE_ERASE		1
+#define	SPM_STATE_WRITE		2
+#endif //SPM_ASYNC
+
+#if defined(SPM_SKIP_EQUAL) && !defined(SPM_ASYNC)
+	#error "SPM_SKIP_EQUAL requires SPM_ASYNC"
+#endif
+
+#if defined(SPM_ZERO_COPY) && !defined(SPM_ASYNC)
+	#error "SPM_ZERO_COPY requires SPM_ASYNC"
+#endif
+
+#if defined(SPM_SKIP_ERASE) && !defined(SPM_SKIP_EQUAL)
+	#error "SPM_SKIP_ERASE requires SPM_SKIP_EQUAL"
+#endif
+
+#if defined(LZ_UPLOAD) && !defined(SPM_ASYNC)
+	#error "LZ_UPLOAD requires SPM_ASYNC"
+#endif
+
+#if defined(EEPROM_QUEUE) && (!defined(EEPROM_SPLIT_WRITE) || !defined(SPM_ASYNC))
+	#error "EEPROM_QUEUE requires EEPROM_SPLIT_WRITE and SPM_ASYNC"
+#endif
+
+#ifdef EEPROM_QUEUE
+#define	EEPROM_QUEUE_SIZE	128		// must be power of two
+#define	EEPROM_QUEUE_MASK	(EEPROM_QUEUE_SIZE - 1)
+#endif //EEPROM_QUEUE
+
+#if defined(DUMP_RANGE) && !defined(STREAM_READ)
+	#error "DUMP_RANGE requires STREAM_READ"
+#endif
+
+#ifdef DUMP_RANGE
+/*
+ * CMD_DUMP_PRUSA3D memory (msgBuffer[1]) and answer flags (msgBuffer[2])
+ */
+#define	DUMP_MEMORY_FLASH	0
+#define	DUMP_MEMORY_EEPROM	1
+#define	DUMP_FLAG_LAST		0x01	// last answer frame of dump
+
+#define	DUMP_CHUNK_MAX		4096	// max. dumped bytes per answer frame (CRC checkpoint)
+#define	DUMP_RUN_MAX		130		// RLE run 3..130 bytes
+#define	DUMP_LITERAL_MAX	128		// RLE literal group 1..128 bytes
+#endif //DUMP_RANGE
+
+#ifdef LZ_UPLOAD
+/*
+ * CMD_PROGRAM_FLASH_LZ_PRUSA3D flags (msgBuffer[3])
+ */
+#define	LZ_FLAG_FIRST		0x01	// first block of stream, reset decoder
+#define	LZ_FLAG_LAST		0x02	// last block of stream, write partial page
+
+/*
+ * States of the LZSS decoder
+ */
+#define	LZ_STATE_FLAGS		0
+#define	LZ_STATE_ITEM		1
+#define	LZ_STATE_LENGTH		2
+#endif //LZ_UPLOAD
+
 
 #define UART_BAUD_SELECT(baudRate,xtalCpu) (((float)(xtalCpu))/(((float)(baudRate))*8.0)-1.0+0.5)
 
@@ -430,6 +700,7 @@ LICENSE:
 #define ST_GET_DATA		5
 #define	ST_GET_CHECK	6
 #define	ST_PROCESS		7
+#define	ST_WINDOW_ERROR	8	// window mode, answer ANSWER_CKSUM_ERROR for expected frame
 
 /*
  * use 16bit address variable for ATmegas with <= 64K flash
@@ -445,11 +716,60 @@ LICENSE:
  */
 static void sendchar(char c);
 //static unsigned char recchar(void);
+#ifdef SPM_ASYNC
+static void spmPoll(void);
+#endif //SPM_ASYNC
+#ifdef EEPROM_SPLIT_WRITE
+static void eepromRelease(void);
+#endif //EEPROM_SPLIT_WRITE
+#ifdef EEPROM_QUEUE
+static void eepromResume(void);
+static void eepromSync(void);
+#endif //EEPROM_QUEUE
 
 #ifdef DUALSERIAL
-int selectedSerial;
+volatile int selectedSerial;
 #endif //DUALSERIAL
 
+#ifdef SERIAL_RX_BUFFER
+#if (SERIAL_RX_BUFFER_SIZE > 256)
+	typedef uint16_t rxindex_t;
+#else
+	typedef uint8_t rxindex_t;
+#endif
+static volatile unsigned char	rxBuffer[SERIAL_RX_BUFFER_SIZE] __attribute__ ((section (".noinit")));
+static volatile rxindex_t		rxHead	=	0;	// written by RX interrupt
+static volatile rxindex_t		rxTail	=	0;	// written by main loop
+
+/*
+ * 16bit indexes are accessed with interrupts disabled
+ */
+#if (SERIAL_RX_BUFFER_SIZE > 256)
+	#define	rxAtomicBegin()	cli()
+	#define	rxAtomicEnd()	sei()
+#else
+	#define	rxAtomicBegin()
+	#define	rxAtomicEnd()
+#endif
+
+static inline unsigned char rxAvailable(void)
+{
+	unsigned char	available;
+
+	rxAtomicBegin();
+	available	=	(rxHead != rxTail);
+	rxAtomicEnd();
+	return available;
+}
+#endif //SERIAL_RX_BUFFER
+
+#ifdef SERIAL_TX_BUFFER
+static volatile unsigned char	txBuffer[SERIAL_TX_BUFFER_SIZE] __attribute__ ((section (".noinit")));
+static volatile uint8_t			txHead	=	0;	// written by main loop
+static volatile uint8_t			txTail	=	0;	// written by UDRE interrupt
+#endif //SERIAL_TX_BUFFER
+static unsigned char			txPending	=	0;	// byte written since last flush
+
 /*
  * since this bootloader is not linked against the avr-gcc crt1 functions,
  * to reduce the code size, we need to provide our own initialization
@@ -523,42 +843,172 @@ const unsigned long ulRamEnd = RAMEND;
 const unsigned long ulBootSize = BOOTSIZE;
 const unsigned long ulAppEnd = APP_END;
 */
+#ifdef SERIAL_TX_BUFFER
+//*****************************************************************************
+/*
+ * Move next byte from transmit ring buffer to the data register,
+ * disable UDRE interrupt when the ring buffer is empty
+ */
+ISR(USART0_UDRE_vect)
+{
+	if (txTail != txHead)
+	{
+		UART_STATUS_REG0	|=	(1 << UART_TRANSMIT_COMPLETE0);		// delete TXCflag
+		UART_DATA_REG0		=	txBuffer[txTail];
+		txTail				=	(txTail + 1) & SERIAL_TX_BUFFER_MASK;
+	}
+	else
+		UART_CONTROL_REG0	&=	~(1 << UDRIE0);
+}
+
+ISR(USART2_UDRE_vect)
+{
+	if (txTail != txHead)
+	{
+		UART_STATUS_REG2	|=	(1 << UART_TRANSMIT_COMPLETE2);		// delete TXCflag
+		UART_DATA_REG2		=	txBuffer[txTail];
+		txTail				=	(txTail + 1) & SERIAL_TX_BUFFER_MASK;
+	}
+	else
+		UART_CONTROL_REG2	&=	~(1 << UDRIE2);
+}
+#endif //SERIAL_TX_BUFFER
+
 //*****************************************************************************
 /*
- * send single byte to USART, wait until transmission is completed
+ * send single byte to USART, wait only until the data register is empty
+ * (or until there is space in the transmit ring buffer), the byte is shifted
+ * out while the caller prepares the next one
  */
 static void sendchar(char c)
 {
-#ifdef DUALSERIAL
+	txPending	=	1;
+#ifdef SERIAL_TX_BUFFER
+	uint8_t	head	=	(txHead + 1) & SERIAL_TX_BUFFER_MASK;
+	while (head == txTail);											// wait for space in ring buffer
+	txBuffer[txHead]	=	c;
+	txHead				=	head;
+	if (selectedSerial == 0)
+		UART_CONTROL_REG0	|=	(1 << UDRIE0);						// start transmission
+	else if (selectedSerial == 2)
+		UART_CONTROL_REG2	|=	(1 << UDRIE2);
+#elif defined(DUALSERIAL)
 	if (selectedSerial == 0)
 	{
+		while (!(UART_STATUS_REG0 & (1 << UART_DATA_REG_EMPTY0)));	// wait for empty data register
+		UART_STATUS_REG0 |= (1 << UART_TRANSMIT_COMPLETE0);			// delete TXCflag
 		UART_DATA_REG0 = c;												// prepare transmission
-		while (!(UART_STATUS_REG0 & (1 << UART_TRANSMIT_COMPLETE0)));	// wait until byte sent
-		UART_STATUS_REG0 |= (1 << UART_TRANSMIT_COMPLETE0);				// delete TXCflag
 	}
 	else if (selectedSerial == 2)
 	{
+		while (!(UART_STATUS_REG2 & (1 << UART_DATA_REG_EMPTY2)));	// wait for empty data register
+		UART_STATUS_REG2 |= (1 << UART_TRANSMIT_COMPLETE2);			// delete TXCflag
 		UART_DATA_REG2 = c;												// prepare transmission
-		while (!(UART_STATUS_REG2 & (1 << UART_TRANSMIT_COMPLETE2)));	// wait until byte sent
-		UART_STATUS_REG2 |= (1 << UART_TRANSMIT_COMPLETE2);				// delete TXCflag
 	}
 #else //DUALSERIAL
-	UART_DATA_REG	=	c;										// prepare transmission
-	while (!(UART_STATUS_REG & (1 << UART_TRANSMIT_COMPLETE)));	// wait until byte sent
-	UART_STATUS_REG |= (1 << UART_TRANSMIT_COMPLETE);			// delete TXCflag
+	while (!(UART_STATUS_REG & (1 << UART_DATA_REG_EMPTY)));		// wait for empty data register
+	UART_STATUS_REG |= (1 << UART_TRANSMIT_COMPLETE);				// delete TXCflag
+	UART_DATA_REG	=	c;											// prepare transmission
+#endif //DUALSERIAL
+}
+
+//*****************************************************************************
+/*
+ * wait until all bytes are sent (before leaving bootloader)
+ */
+static void sendflush(void)
+{
+	if (!txPending)
+		return;
+#ifdef SERIAL_TX_BUFFER
+	while (txTail != txHead);										// wait for empty ring buffer
+#endif //SERIAL_TX_BUFFER
+#ifdef DUALSERIAL
+	if (selectedSerial == 0)
+		while (!(UART_STATUS_REG0 & (1 << UART_TRANSMIT_COMPLETE0)));	// wait until byte sent
+	else if (selectedSerial == 2)
+		while (!(UART_STATUS_REG2 & (1 << UART_TRANSMIT_COMPLETE2)));	// wait until byte sent
+#else //DUALSERIAL
+	while (!(UART_STATUS_REG & (1 << UART_TRANSMIT_COMPLETE)));		// wait until byte sent
 #endif //DUALSERIAL
+	txPending	=	0;
+}
+
+//*****************************************************************************
+/*
+ * send answer header (start, sequence number, size, token), returns checksum
+ */
+static unsigned char sendHeader(unsigned char seqNum, unsigned int msgLength)
+{
+	unsigned char	checksum	=	MESSAGE_START ^ seqNum ^ (msgLength >> 8) ^ (msgLength & 0xff) ^ TOKEN;
+
+	sendchar(MESSAGE_START);
+	sendchar(seqNum);
+	sendchar(msgLength >> 8);
+	sendchar(msgLength & 0xff);
+	sendchar(TOKEN);
+	return checksum;
+}
+
+//*****************************************************************************
+/*
+ * send answer bytes, returns updated checksum
+ */
+static unsigned char sendBytes(const unsigned char *p, unsigned int size, unsigned char checksum)
+{
+	while (size--)
+	{
+		sendchar(*p);
+		checksum	^=	*p++;
+	}
+	return checksum;
+}
+
+#ifdef STREAM_READ
+//*****************************************************************************
+/*
+ * send flash bytes, read with (E)LPM Z+ while previous byte is shifted out,
+ * returns updated checksum
+ */
+static unsigned char sendFlash(address_t address, unsigned int size, unsigned char checksum)
+{
+	uint16_t		z	=	address;
+	unsigned char	c;
+
+#if (FLASHEND > 0x10000)
+	RAMPZ	=	address >> 16;				// ELPM Z+ increments RAMPZ:Z
+#endif
+	while (size--)
+	{
+	#if (FLASHEND > 0x10000)
+		asm volatile ("elpm %0, Z+" : "=r" (c), "+z" (z));
+	#else
+		asm volatile ("lpm %0, Z+" : "=r" (c), "+z" (z));
+	#endif
+		sendchar(c);
+		checksum	^=	c;
+	}
+#if (FLASHEND > 0x10000)
+	RAMPZ	=	0;
+#endif
+	return checksum;
 }
+#endif //STREAM_READ
 
 
 //************************************************************************
 #ifdef DUALSERIAL
 static int Serial_Available(int serial)
 {
+#ifdef SERIAL_RX_BUFFER
+	return rxAvailable() && (selectedSerial == serial);	// data in ring buffer
+#else
 	if (serial == 0)
 		return (UART_STATUS_REG0 & (1 << UART_RECEIVE_COMPLETE0));	// wait for data
 	else if (serial == 2)
 		return (UART_STATUS_REG2 & (1 << UART_RECEIVE_COMPLETE2));	// wait for data
 	return 0;
+#endif //SERIAL_RX_BUFFER
 }
 #else //DUALSERIAL
 static int	Serial_Available(void)
@@ -568,6 +1018,40 @@ static int	Serial_Available(void)
 #endif //DUALSERIAL
 
 
+#ifdef SERIAL_RX_BUFFER
+//*****************************************************************************
+/*
+ * Store received byte to ring buffer, the first port which receives
+ * a byte is selected, bytes from the other port are dropped
+ */
+static inline void rxStore(int serial, unsigned char c)
+{
+	rxindex_t	head;
+
+	if (selectedSerial < 0)
+		selectedSerial	=	serial;
+	if (selectedSerial != serial)
+		return;
+	head	=	(rxHead + 1) & SERIAL_RX_BUFFER_MASK;
+	if (head != rxTail)						// drop byte on overflow
+	{
+		rxBuffer[rxHead]	=	c;
+		rxHead				=	head;
+	}
+}
+
+ISR(USART0_RX_vect)
+{
+	rxStore(0, UART_DATA_REG0);
+}
+
+ISR(USART2_RX_vect)
+{
+	rxStore(2, UART_DATA_REG2);
+}
+#endif //SERIAL_RX_BUFFER
+
+
 //*****************************************************************************
 /*
  * Read single byte from USART, block if no data available
@@ -592,18 +1076,143 @@ static int	Serial_Available(void)
 #endif //DUALSERIAL
 }*/
 
+#ifdef SERIAL_RX_BUFFER
+//*****************************************************************************
+/*
+ * Disable receive interrupts and move vectors back to the application section,
+ * must be called before jumping to the application
+ */
+static void releaseInterrupts(void)
+{
+#ifdef EEPROM_QUEUE
+	eepromSync();						// queued EEPROM writes are done before leaving
+#endif
+#ifdef EEPROM_SPLIT_WRITE
+	eepromRelease();
+#endif
+#ifdef LCD_HD44780
+	lcd_sync();							// queued LCD writes are done, Timer2 stopped
+#endif
+	cli();
+#ifdef TIMER_CLOCK
+	TIMSK0	=	0;							// Timer0 back to reset state
+	TCCR0B	=	0;
+	TCCR0A	=	0;
+	OCR0A	=	0;
+	TCNT0	=	0;
+	TIFR0	=	(1 << OCF0A);
+#endif
+	UART_CONTROL_REG0	&=	~((1 << RXCIE0) | (1 << UDRIE0));
+	UART_CONTROL_REG2	&=	~((1 << RXCIE2) | (1 << UDRIE2));
+	MCUCR	=	(1 << IVCE);
+	MCUCR	=	0;
+}
+#endif //SERIAL_RX_BUFFER
+
+#ifdef TIMER_CLOCK
+//*****************************************************************************
+/*
+ * Millisecond clock, Timer0 in CTC mode, prescaler 64
+ */
+static volatile uint16_t	msTicks	=	0;
+
+//*****************************************************************************
+ISR(TIMER0_COMPA_vect)
+{
+	msTicks++;
+}
+
+//*****************************************************************************
+static void timerInit(void)
+{
+	OCR0A	=	(F_CPU / 64 / 1000) - 1;
+	TCCR0A	=	(1 << WGM01);				// CTC
+	TCCR0B	=	(1 << CS01) | (1 << CS00);	// F_CPU / 64
+	TIMSK0	=	(1 << OCIE0A);
+}
+
+//*****************************************************************************
+static uint16_t millis(void)
+{
+	uint16_t	ms;
+
+	cli();
+	ms	=	msTicks;
+	sei();
+	return ms;
+}
+
+//*****************************************************************************
+/*
+ * returns != 0 when ms milliseconds passed since start (wraps after 65 seconds)
+ */
+static unsigned char timeElapsed(uint16_t start, uint16_t ms)
+{
+	return (uint16_t)(millis() - start) >= ms;
+}
+#endif //TIMER_CLOCK
+
+#ifdef BAUD_SWITCH
+#ifdef TIMER_CLOCK
+static uint8_t	baudFallbackCount	=	0;	// != 0 while new baudrate is not confirmed by valid frame
+static uint16_t	baudFallbackStart;			// time of baudrate switch
+#else
+static uint32_t	baudFallbackCount	=	0;	// != 0 while new baudrate is not confirmed by valid frame
+#endif
+
+//*****************************************************************************
+/*
+ * set UBRR of both UARTs (double speed), pending answer is sent with old baudrate
+ */
+static void setBaudDivisor(uint16_t divisor)
+{
+	sendflush();
+	UART_BAUD_RATE_HIGH0	=	divisor >> 8;
+	UART_BAUD_RATE_LOW0		=	divisor & 0xff;
+	UART_BAUD_RATE_HIGH2	=	divisor >> 8;
+	UART_BAUD_RATE_LOW2		=	divisor & 0xff;
+}
+#endif //BAUD_SWITCH
+
 #define	MAX_TIME_COUNT	(F_CPU >> 1)
 //*****************************************************************************
 static unsigned char recchar_timeout(void)
 {
+#ifdef TIMER_CLOCK
+	uint16_t start = millis();
+#else
 	uint32_t count = 0;
+#endif
 #ifdef DUALSERIAL
 	while (1)
 	{
+	#ifdef SERIAL_RX_BUFFER
+		#ifdef SPM_ASYNC
+		spmPoll();									// advance flash programming between received bytes
+		#endif
+		if (rxAvailable()) break;
+	#else
 		if ((selectedSerial == 0) && (UART_STATUS_REG0 & (1 << UART_RECEIVE_COMPLETE0))) break;
 		else if ((selectedSerial == 2) && (UART_STATUS_REG2 & (1 << UART_RECEIVE_COMPLETE2))) break;
+	#endif
+	#ifdef BAUD_SWITCH
+		#ifdef TIMER_CLOCK
+		if (baudFallbackCount && timeElapsed(baudFallbackStart, BAUD_FALLBACK_MS))
+		{
+			baudFallbackCount	=	0;
+			setBaudDivisor(UART_BAUD_SELECT(BAUDRATE,F_CPU));	// host did not follow, back to default baudrate
+		}
+		#else
+		if (baudFallbackCount && (--baudFallbackCount == 0))
+			setBaudDivisor(UART_BAUD_SELECT(BAUDRATE,F_CPU));	// host did not follow, back to default baudrate
+		#endif
+	#endif
+	#ifdef TIMER_CLOCK
+		if (timeElapsed(start, RX_TIMEOUT_MS))
+	#else
 		count++;
 		if (count > MAX_TIME_COUNT)
+	#endif
 		{
 		unsigned int	data;
 		#if (FLASHEND > 0x10000)
@@ -613,15 +1222,33 @@ static unsigned char recchar_timeout(void)
 		#endif
 			if (data != 0xffff)					//*	make sure its valid before jumping to it.
 			{
+			#ifdef SERIAL_RX_BUFFER
+				releaseInterrupts();
+			#elif defined(EEPROM_SPLIT_WRITE)
+				eepromRelease();
+			#endif
 				asm volatile(
 						"clr	r30		\n\t"
 						"clr	r31		\n\t"
 						"ijmp	\n\t"
 						);
 			}
+		#ifdef TIMER_CLOCK
+			start	=	millis();
+		#else
 			count	=	0;
+		#endif
 		}
 	}
+#ifdef SERIAL_RX_BUFFER
+	{
+		unsigned char c	=	rxBuffer[rxTail];
+		rxAtomicBegin();
+		rxTail	=	(rxTail + 1) & SERIAL_RX_BUFFER_MASK;
+		rxAtomicEnd();
+		return c;
+	}
+#endif
 	if (selectedSerial == 0) return UART_DATA_REG0;
 	else if (selectedSerial == 2) return UART_DATA_REG2;
 	return 0;
@@ -640,6 +1267,9 @@ static unsigned char recchar_timeout(void)
 		#endif
 			if (data != 0xffff)					//*	make sure its valid before jumping to it.
 			{
+			#ifdef EEPROM_SPLIT_WRITE
+				eepromRelease();
+			#endif
 				asm volatile(
 						"clr	r30		\n\t"
 						"clr	r31		\n\t"
@@ -664,6 +1294,15 @@ void initUart()
 	UART_STATUS_REG2	|=	(1 <<UART_DOUBLE_SPEED2);
 	UART_BAUD_RATE_LOW2	=	UART_BAUD_SELECT(BAUDRATE,F_CPU);
 	UART_CONTROL_REG2	=	(1 << UART_ENABLE_RECEIVER2) | (1 << UART_ENABLE_TRANSMITTER2);
+#ifdef SERIAL_RX_BUFFER
+	// move interrupt vectors to the bootloader section and enable receive interrupts
+	selectedSerial		=	-1;
+	MCUCR				=	(1 << IVCE);
+	MCUCR				=	(1 << IVSEL);
+	UART_CONTROL_REG0	|=	(1 << RXCIE0);
+	UART_CONTROL_REG2	|=	(1 << RXCIE2);
+	sei();
+#endif //SERIAL_RX_BUFFER
 }
 #endif //DUALSERIAL
 
@@ -677,79 +1316,1033 @@ void initUart()
 	sendchar('\n');
 }*/
 
-#ifdef EINSYBOARD
+#ifdef EINSYBOARD
+
+void blinkBootLed(int state)
+{
+    if (state == 1)
+        PORTB = 0b10000000;
+    else
+        PORTB = 0b00000000;
+}
+
+//Heaters off (PG5=0, PE5=0)
+//Fans on (PH5=1, PH3=1)
+//Motors off (PA4..7=1)
+void pinsToDefaultState()
+{
+/*
+    DDRG = 0b00001000;
+    DDRE = 0b00001000;
+    DDRH = 0b00101000;
+    DDRA = 0b00011110;
+    DDRB = 0b10000000;
+    PORTH = 0b00101000;
+    PORTG = 0b00000000;
+    PORTE = 0b00000000;
+    PORTA = 0b00000000;*/ //original code
+	DDRA |= 0b11110000; //PA4..7 out
+	PORTA |= 0b11110000; //PA4..7 = 1
+	DDRE |= 0b00100000; //PE5 out
+	PORTE &= 0b11011111; //PE5 = 0
+	DDRG |= 0b00100000; //PG5 out
+	PORTG &= 0b11011111; //PG5 = 0
+	DDRH |= 0b00101000; //PH5, PH3 out
+	PORTH |= 0b00101000; //PH5, PH3 = 1
+}
+
+#endif //EINSYBOARD
+
+//*****************************************************************************
+/*
+ * pages erased in this session, one bit per application page
+ * page is erased before its first write, later writes to the same page only program
+ * unless they set bits (see spmPageMerge(), erasePageAgain())
+ * (not cleared at startup, see erasedPagesClear())
+ */
+static uint8_t	erasedPages[((APP_END / SPM_PAGESIZE) + 7) / 8] __attribute__ ((section (".noinit")));
+
+//*****************************************************************************
+/*
+ * all pages are erased again on next write
+ */
+static void erasedPagesClear(void)
+{
+	unsigned char	ii;
+
+	for (ii = 0; ii < sizeof(erasedPages); ii++)
+		erasedPages[ii]	=	0;
+}
+
+//*****************************************************************************
+/*
+ * returns page address to erase before writing to address, APP_END if page
+ * is already erased (or is not in application section) and marks page as erased
+ */
+static address_t erasePage(address_t address)
+{
+	unsigned int	page	=	address / SPM_PAGESIZE;
+	uint8_t			mask	=	1 << (page & 7);
+
+	if (address >= APP_END) //erase and write only blocks with address less 0x3e000
+		return APP_END;		//because prevent "brick"
+	if (erasedPages[page >> 3] & mask)
+		return APP_END;
+	erasedPages[page >> 3]	|=	mask;
+	return address & ~((address_t)SPM_PAGESIZE - 1);
+}
+
+#ifndef SPM_ASYNC
+//*****************************************************************************
+/*
+ * page already erased in this session is written again, it has to be erased again
+ * when the new data sets bits, the rest of the page is then copied from flash to the
+ * temporary page buffer before the erase (the erase does not clear it),
+ * returns page address to erase, APP_END when the data only clears bits
+ */
+static address_t erasePageAgain(address_t address, unsigned char *p, unsigned int size)
+{
+	address_t		pageAddress	=	address & ~((address_t)SPM_PAGESIZE - 1);
+	unsigned int	offset		=	address - pageAddress;
+	unsigned int	ii;
+
+	for (ii = 0; ii < size; ii += 2)
+	{
+		unsigned int	data	=	p[ii] | (p[ii + 1] << 8);
+	#if (FLASHEND > 0x10000)
+		unsigned int	flash	=	pgm_read_word_far(address + ii);
+	#else
+		unsigned int	flash	=	pgm_read_word_near(address + ii);
+	#endif
+
+		if ((flash & data) != data)
+			break;
+	}
+	if (ii >= size)
+		return APP_END;
+	for (ii = 0; ii < SPM_PAGESIZE; ii += 2)
+	{
+		unsigned int	flash;
+
+		if ((ii >= offset) && (ii < (offset + size)))
+			continue;					// filled with new data after erase
+	#if (FLASHEND > 0x10000)
+		flash	=	pgm_read_word_far(pageAddress + ii);
+	#else
+		flash	=	pgm_read_word_near(pageAddress + ii);
+	#endif
+		cli();
+		boot_page_fill(pageAddress + ii, flash);
+		sei();
+	}
+	return pageAddress;
+}
+#endif //SPM_ASYNC
+
+#ifdef SPM_ASYNC
+//*****************************************************************************
+/*
+ * Asynchronous SPM engine
+ * CMD_PROGRAM_FLASH_ISP only copies the page to a RAM page buffer and answers,
+ * erase -> fill -> write is done here, one step per call, while the next
+ * frame is received by the RX interrupt
+ */
+typedef struct
+{
+	address_t		address;			// first byte address to write
+	address_t		eraseAddress;		// page to erase before writing (APP_END = no erase)
+	unsigned int	size;				// number of bytes to write (0 = erase only)
+	unsigned char	data[SPM_PAGESIZE];
+} spm_page_t;
+
+static spm_page_t	spmPages[SPM_PAGE_BUFFERS] __attribute__ ((section (".noinit")));
+static uint8_t		spmHead		=	0;	// next free page buffer
+static uint8_t		spmTail		=	0;	// page buffer being programmed
+static uint8_t		spmCount	=	0;	// number of queued page buffers
+static uint8_t		spmState	=	SPM_STATE_IDLE;
+#ifdef SPM_SKIP_EQUAL
+static uint16_t		spmSkippedPages	=	0;	// reported by PARAM_SKIPPED_PAGES_xxx_PRUSA3D
+#ifdef SPM_SKIP_ERASE
+static uint16_t		spmSkippedErases	=	0;	// reported by PARAM_SKIPPED_ERASES_xxx_PRUSA3D
+#endif
+#endif //SPM_SKIP_EQUAL
+
+#define	SPM_PAGE_EQUAL		0	// flash already holds the page
+#define	SPM_PAGE_PROGRAM	1	// write only, data only clears bits
+#define	SPM_PAGE_ERASE		2	// erase and write
+
+//*****************************************************************************
+/*
+ * compare page buffer with flash content, page is equal when flash already
+ * holds the data and the rest of the page is erased (or is not going to be erased),
+ * erase is not needed when the data only clears bits (flash can only turn 1s into 0s)
+ */
+static unsigned char spmPageCheck(spm_page_t *page)
+{
+	address_t		pageAddress	=	page->address & ~((address_t)SPM_PAGESIZE - 1);
+	unsigned int	offset		=	page->address - pageAddress;
+	unsigned char	erase		=	(page->eraseAddress < APP_END);
+	unsigned char	result		=	SPM_PAGE_EQUAL;
+	unsigned int	ii;
+
+	if (erase && (page->eraseAddress != pageAddress))
+		return SPM_PAGE_ERASE;				// erase of another page
+	for (ii = 0; ii < SPM_PAGESIZE; ii += 2)
+	{
+		unsigned int	data;
+		unsigned int	flash;
+
+		if ((ii >= offset) && (ii < (offset + page->size)))
+			data	=	page->data[ii - offset] | (page->data[ii - offset + 1] << 8);
+		else if (erase)
+			data	=	0xffff;
+		else
+			continue;						// not written, keeps flash content
+	#if (FLASHEND > 0x10000)
+		flash	=	pgm_read_word_far(pageAddress + ii);
+	#else
+		flash	=	pgm_read_word_near(pageAddress + ii);
+	#endif
+		if (flash == data)
+			continue;
+	#ifdef SPM_SKIP_ERASE
+		if ((flash & data) == data)
+		{
+			result	=	SPM_PAGE_PROGRAM;	// only clears bits
+			continue;
+		}
+	#endif
+		return SPM_PAGE_ERASE;
+	}
+	return result;
+}
+
+//*****************************************************************************
+/*
+ * page already erased in this session needs erase again (written twice with
+ * data setting bits), page buffer is extended to the whole page with flash
+ * content around the new data, so erase keeps the rest of the page
+ */
+static void spmPageMerge(spm_page_t *page)
+{
+	address_t		pageAddress	=	page->address & ~((address_t)SPM_PAGESIZE - 1);
+	unsigned int	offset		=	page->address - pageAddress;
+	unsigned int	ii;
+
+	for (ii = page->size; ii--; )
+		page->data[offset + ii]	=	page->data[ii];
+	for (ii = 0; ii < SPM_PAGESIZE; ii++)
+	{
+		if ((ii >= offset) && (ii < (offset + page->size)))
+			continue;
+	#if (FLASHEND > 0x10000)
+		page->data[ii]	=	pgm_read_byte_far(pageAddress + ii);
+	#else
+		page->data[ii]	=	pgm_read_byte_near(pageAddress + ii);
+	#endif
+	}
+	page->address		=	pageAddress;
+	page->size			=	SPM_PAGESIZE;
+	page->eraseAddress	=	pageAddress;
+}
+
+//*****************************************************************************
+static void spmPoll(void)
+{
+	spm_page_t		*page	=	&spmPages[spmTail];
+	unsigned char	*p;
+	address_t		address;
+	unsigned int	size;
+
+	if (boot_spm_busy())
+		return;							// previous erase/write still running
+#ifdef EEPROM_QUEUE
+	eepromResume();						// EE_READY interrupt stops while flash is busy
+#endif
+	if (!eeprom_is_ready())
+		return;							// no SPM while EEPROM is written
+	switch (spmState)
+	{
+		case SPM_STATE_IDLE:
+			if (spmCount == 0)
+				return;
+		#ifdef SPM_SKIP_EQUAL
+			if (page->size)
+		#else
+			if (page->size && (page->eraseAddress == APP_END))	// page was written before in this session
+		#endif
+			{
+				switch (spmPageCheck(page))
+				{
+				#ifdef SPM_SKIP_EQUAL
+					case SPM_PAGE_EQUAL:
+						spmSkippedPages++;
+						spmState	=	SPM_STATE_WRITE;	// nothing to erase and write
+						return;
+				#endif
+
+				#ifdef SPM_SKIP_ERASE
+					case SPM_PAGE_PROGRAM:
+						spmSkippedErases++;
+						page->eraseAddress	=	APP_END;	// write only
+						break;
+				#endif
+
+					case SPM_PAGE_ERASE:
+						if (page->eraseAddress == APP_END)
+							spmPageMerge(page);			// bitmap says erased, but flash has to be erased again
+						break;
+				}
+			}
+			if (page->eraseAddress < APP_END)
+			{
+				cli();
+				boot_page_erase(page->eraseAddress);	// Perform page erase
+				sei();
+				spmState	=	SPM_STATE_ERASE;
+				break;
+			}
+			//*	fall thru
+
+		case SPM_STATE_ERASE:
+			if (page->size)
+			{
+				p		=	page->data;
+				address	=	page->address;
+				size	=	page->size;
+				do {
+					unsigned int data	=	p[0] | (p[1] << 8);
+					cli();
+					boot_page_fill(address, data);
+					sei();
+					p		+=	2;
+					address	+=	2;
+					size	-=	2;
+				} while (size);
+				cli();
+				boot_page_write(page->address);
+				sei();
+				spmState	=	SPM_STATE_WRITE;
+				break;
+			}
+			//*	fall thru
+
+		case SPM_STATE_WRITE:
+			cli();
+			boot_rww_enable();				// Re-enable the RWW section
+			sei();
+			spmTail		=	(spmTail + 1) % SPM_PAGE_BUFFERS;
+			spmCount--;
+			spmState	=	SPM_STATE_IDLE;
+			break;
+	}
+}
+
+//*****************************************************************************
+/*
+ * wait until all queued pages are programmed (RWW section readable again)
+ */
+static void spmSync(void)
+{
+	while (spmCount)
+		spmPoll();
+}
+
+//*****************************************************************************
+/*
+ * return free page buffer, waits while all buffers are in use
+ */
+static unsigned char *spmPageBuffer(void)
+{
+	while (spmCount == SPM_PAGE_BUFFERS)
+		spmPoll();
+	return spmPages[spmHead].data;
+}
+
+//*****************************************************************************
+/*
+ * queue page buffer returned by spmPageBuffer(), page is erased first unless
+ * it was already erased in this session
+ */
+static void spmPageCommit(address_t address, unsigned int size)
+{
+	spm_page_t	*page	=	&spmPages[spmHead];
+
+	if (address >= APP_END)
+		return;
+	page->eraseAddress	=	erasePage(address);
+	if ((page->eraseAddress == APP_END) && (size == 0))
+		return;
+	page->address	=	address;
+	page->size		=	size;
+	spmHead	=	(spmHead + 1) % SPM_PAGE_BUFFERS;
+	spmCount++;
+	spmPoll();							// start erase right away
+}
+
+#ifdef LZ_UPLOAD
+//*****************************************************************************
+/*
+ * LZSS decoder for CMD_PROGRAM_FLASH_LZ_PRUSA3D
+ * stream is a sequence of groups, flag byte followed by 8 items, flag bits LSB first:
+ *   1 = literal, one byte
+ *   0 = match, two bytes: distance - 1 (1..256 bytes back), length - 3 (3..258 bytes)
+ * decoder state is kept between frames, so items may be split over frames
+ * decompressed bytes go straight to the SPM page buffers
+ */
+static unsigned char	lzWindow[256] __attribute__ ((section (".noinit")));	// history of decompressed bytes, cleared by LZ_FLAG_FIRST
+static uint8_t			lzWindowPos;
+static uint8_t			lzState;
+static uint8_t			lzFlags;
+static uint8_t			lzFlagBits;			// items left in group
+static uint8_t			lzDistance;
+static address_t		lzAddress;			// address of current page
+static unsigned int		lzPageFill;			// bytes in current page
+static unsigned int		lzCount;			// decompressed bytes of current frame
+static uint8_t			lzActive;			// stream opened by LZ_FLAG_FIRST, partial page is in spmPageBuffer()
+
+//*****************************************************************************
+static void lzPut(unsigned char c)
+{
+	lzWindow[lzWindowPos++]	=	c;
+	spmPageBuffer()[lzPageFill++]	=	c;
+	lzCount++;
+	if (lzPageFill == SPM_PAGESIZE)
+	{
+		spmPageCommit(lzAddress, SPM_PAGESIZE);
+		lzAddress	+=	SPM_PAGESIZE;
+		lzPageFill	=	0;
+	}
+}
+
+//*****************************************************************************
+static void lzDecode(unsigned char *p, unsigned int size)
+{
+	while (size--)
+	{
+		unsigned char	c	=	*p++;
+
+		switch (lzState)
+		{
+			case LZ_STATE_FLAGS:
+				lzFlags		=	c;
+				lzFlagBits	=	8;
+				lzState		=	LZ_STATE_ITEM;
+				continue;
+
+			case LZ_STATE_ITEM:
+				if (!(lzFlags & 1))
+				{
+					lzDistance	=	c;
+					lzState		=	LZ_STATE_LENGTH;
+					continue;
+				}
+				lzPut(c);
+				break;
+
+			case LZ_STATE_LENGTH:
+				{
+					unsigned int	length	=	c + 3;
+					uint8_t			pos		=	lzWindowPos - lzDistance - 1;
+
+					while (length--)
+						lzPut(lzWindow[pos++]);
+				}
+				break;
+		}
+		// item done
+		lzFlags	>>=	1;
+		lzState	=	(--lzFlagBits) ? LZ_STATE_ITEM : LZ_STATE_FLAGS;
+	}
+}
+#endif //LZ_UPLOAD
+#endif //SPM_ASYNC
+
+#ifdef PAGE_CRC
+//*****************************************************************************
+/*
+ * CRC-16 (poly 0xA001, init 0xFFFF) of one flash page
+ */
+static uint16_t pageCrc(address_t address)
+{
+	uint16_t		crc		=	0xffff;
+	unsigned int	size	=	SPM_PAGESIZE;
+
+	do {
+	#if (FLASHEND > 0x10000)
+		crc	=	_crc16_update(crc, pgm_read_byte_far(address));
+	#else
+		crc	=	_crc16_update(crc, pgm_read_byte_near(address));
+	#endif
+		address++;
+	} while (--size);
+	return crc;
+}
+#endif //PAGE_CRC
+
+#ifdef VERIFY_CRC32
+//*****************************************************************************
+/*
+ * CRC-32 (IEEE 802.3, reflected poly 0xEDB88320), one byte per step
+ * CRC is linear, so the byte table entry is low nibble entry ^ high nibble entry:
+ * two 16 entry tables (128 bytes) in the bootloader section instead of 1 KB
+ */
+static const uint32_t crc32Table[32] PROGMEM =
+{
+	// low nibble
+	0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA, 0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
+	0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988, 0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
+	// high nibble
+	0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+	0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+#define	CRC32_BLOCK		16			// flash bytes read between RAMPZ switches
+
+#if (FLASHEND > 0x10000)
+	#define	LPM_Z_INC	"elpm"		// ELPM Z+ increments RAMPZ:Z
+#else
+	#define	LPM_Z_INC	"lpm"
+#endif
+
+//*****************************************************************************
+/*
+ * table entry at z, RAMPZ has to point to the table
+ */
+static inline uint32_t crc32Entry(uint16_t z)
+{
+	uint32_t	entry;
+
+	asm volatile (
+		LPM_Z_INC "	%A0, Z+	\n\t"
+		LPM_Z_INC "	%B0, Z+	\n\t"
+		LPM_Z_INC "	%C0, Z+	\n\t"
+		LPM_Z_INC "	%D0, Z	\n\t"
+		: "=r" (entry), "+z" (z));
+	return entry;
+}
+
+//*****************************************************************************
+/*
+ * flash is read in blocks with (E)LPM Z+, then RAMPZ is switched to the table,
+ * about 45 cycles per byte (instruction count, 0.7 s for 248 KB at 16 MHz)
+ */
+static uint32_t flashCrc32(address_t address, uint32_t size)
+{
+	uint32_t		crc		=	0xffffffff;
+	uint32_t		table	=	pgm_get_far_address(crc32Table);
+	unsigned char	block[CRC32_BLOCK];
+
+	while (size)
+	{
+		unsigned char	count	=	(size > CRC32_BLOCK) ? CRC32_BLOCK : size;
+		unsigned char	ii;
+		uint16_t		z		=	address;
+
+	#if (FLASHEND > 0x10000)
+		RAMPZ	=	address >> 16;
+	#endif
+		for (ii = 0; ii < count; ii++)
+			asm volatile (LPM_Z_INC "	%0, Z+" : "=r" (block[ii]), "+z" (z));
+	#if (FLASHEND > 0x10000)
+		RAMPZ	=	table >> 16;
+	#endif
+		for (ii = 0; ii < count; ii++)
+		{
+			unsigned char	index	=	crc ^ block[ii];
+
+			crc	=	(crc >> 8)
+				^	crc32Entry((uint16_t)table + ((index & 0x0f) << 2))
+				^	crc32Entry((uint16_t)table + (16 * 4) + ((index & 0xf0) >> 2));
+		}
+		address	+=	count;
+		size	-=	count;
+	}
+#if (FLASHEND > 0x10000)
+	RAMPZ	=	0;
+#endif
+	return ~crc;
+}
+#endif //VERIFY_CRC32
+
+#ifdef EEPROM_SPLIT_WRITE
+//*****************************************************************************
+/*
+ * write EEPROM byte, unchanged byte is skipped, erase-only (0xff) or write-only
+ * (only clears bits, ~1.8ms) mode is used instead of atomic erase+write (~3.4ms)
+ */
+static void eepromWriteByte(uint16_t address, unsigned char value)
+{
+	unsigned char	old	=	eeprom_read_byte((uint8_t *)address);	// waits for previous write
+	unsigned char	mode;
+	uint8_t			sreg;
+
+	if (old == value)
+		return;
+	if (value == 0xff)
+		mode	=	(1 << EEPM0);				// erase only
+	else if ((old & value) == value)
+		mode	=	(1 << EEPM1);				// write only
+	else
+		mode	=	0;							// erase and write
+	EEAR	=	address;
+	EEDR	=	value;
+	EECR	=	(EECR & (1 << EERIE)) | mode;
+	sreg	=	SREG;						// called from EE_READY interrupt too
+	cli();
+	EECR	|=	(1 << EEMPE);
+	EECR	|=	(1 << EEPE);					// within 4 cycles after EEMPE
+	SREG	=	sreg;
+}
+
+//*****************************************************************************
+/*
+ * wait for last write and set EECR back to reset state (atomic erase and write,
+ * no EE_READY interrupt), application may write EEPROM registers directly,
+ * must be called before leaving
+ */
+static void eepromRelease(void)
+{
+	eeprom_busy_wait();					// EEPM can not be changed while EEPE is set
+	EECR	&=	~((1 << EEPM1) | (1 << EEPM0) | (1 << EERIE));
+}
+#endif //EEPROM_SPLIT_WRITE
+
+#ifdef EEPROM_QUEUE
+//*****************************************************************************
+/*
+ * Background EEPROM writes
+ * CMD_PROGRAM_EEPROM_ISP only queues the bytes and answers, EE_READY interrupt
+ * writes the next byte whenever the EEPROM is ready
+ */
+typedef struct
+{
+	uint16_t		address;
+	unsigned char	value;
+} eeprom_write_t;
+
+static volatile eeprom_write_t	eeQueue[EEPROM_QUEUE_SIZE] __attribute__ ((section (".noinit")));
+static volatile uint8_t	eeHead	=	0;	// next free entry
+static volatile uint8_t	eeTail	=	0;	// next entry to write
+
+//*****************************************************************************
+ISR(EE_READY_vect)
+{
+	if ((eeTail == eeHead) || boot_spm_busy())
+	{
+		EECR	&=	~(1 << EERIE);		// queue empty or flash busy, spmPoll() resumes
+		return;
+	}
+	eepromWriteByte(eeQueue[eeTail].address, eeQueue[eeTail].value);
+	eeTail	=	(eeTail + 1) & EEPROM_QUEUE_MASK;
+}
+
+//*****************************************************************************
+/*
+ * enable EE_READY interrupt if there are queued writes
+ */
+static void eepromResume(void)
+{
+	if (eeTail != eeHead)
+		EECR	|=	(1 << EERIE);
+}
+
+//*****************************************************************************
+/*
+ * queue EEPROM byte write, waits while queue is full
+ */
+static void eepromQueueWrite(uint16_t address, unsigned char value)
+{
+	uint8_t	head	=	(eeHead + 1) & EEPROM_QUEUE_MASK;
+
+	while (head == eeTail)
+		eepromResume();
+	eeQueue[eeHead].address	=	address;
+	eeQueue[eeHead].value	=	value;
+	eeHead	=	head;
+	eepromResume();
+}
+
+//*****************************************************************************
+/*
+ * read EEPROM byte, queued (not yet written) value is returned first
+ */
+static unsigned char eepromRead(uint16_t address)
+{
+	uint8_t			index	=	eeHead;
+	unsigned char	value;
+
+	while (index != eeTail)				// newest entry first
+	{
+		index	=	(index - 1) & EEPROM_QUEUE_MASK;
+		if (eeQueue[index].address == address)
+			return eeQueue[index].value;
+	}
+	EECR	&=	~(1 << EERIE);				// no new write while reading
+	value	=	eeprom_read_byte((uint8_t *)address);	// waits for running write
+	eepromResume();
+	return value;
+}
+
+//*****************************************************************************
+/*
+ * wait until all queued bytes are written
+ */
+static void eepromSync(void)
+{
+	while (eeTail != eeHead)
+	{
+		spmPoll();
+		eepromResume();
+	}
+	eeprom_busy_wait();
+}
+#endif //EEPROM_QUEUE
+
+//*****************************************************************************
+/*
+ * SPM is ignored while EEPROM is written, wait for queued and running EEPROM
+ * writes before SPM not issued by spmPoll()
+ */
+static inline void spmEepromSync(void)
+{
+#ifdef EEPROM_QUEUE
+	eepromSync();
+#else
+	eeprom_busy_wait();
+#endif
+}
+
+#ifdef DUMP_RANGE
+//*****************************************************************************
+/*
+ * read one byte of dumped memory
+ */
+static unsigned char dumpRead(unsigned char memory, address_t address)
+{
+	if (memory == DUMP_MEMORY_EEPROM)
+	#ifdef EEPROM_QUEUE
+		return eepromRead(address);
+	#else
+		return eeprom_read_byte((uint8_t *)(uint16_t)address);
+	#endif
+#if (FLASHEND > 0x10000)
+	return pgm_read_byte_far(address);
+#else
+	return pgm_read_byte_near(address);
+#endif
+}
+
+//*****************************************************************************
+/*
+ * RLE encode dumped memory to buffer until it is full or DUMP_CHUNK_MAX bytes
+ * are encoded, control byte 0x00..0x7f = n+1 literal bytes follow,
+ * 0x80..0xff = next byte repeated (n & 0x7f)+3 times
+ * returns number of encoded bytes, *crc is updated with them
+ */
+static unsigned int dumpEncode(unsigned char memory, address_t address, uint32_t size,
+							   unsigned char *out, unsigned int *outSize, uint16_t *crc)
+{
+	unsigned char	*outEnd		=	out + *outSize;
+	unsigned char	*literal	=	0;			// control byte of open literal group
+	unsigned char	*p			=	out;
+	unsigned int	done		=	0;
+
+	if (size > DUMP_CHUNK_MAX)
+		size	=	DUMP_CHUNK_MAX;
+	while ((done < size) && ((p + 2) <= outEnd))	// one item needs up to 2 bytes
+	{
+		unsigned char	c	=	dumpRead(memory, address);
+		unsigned int	run	=	1;
+		unsigned int	ii;
+
+		while ((run < DUMP_RUN_MAX) && ((done + run) < size) && (dumpRead(memory, address + run) == c))
+			run++;
+		if (run >= 3)
+		{
+			*p++	=	0x80 | (run - 3);
+			*p++	=	c;
+			literal	=	0;
+		}
+		else
+		{
+			run	=	1;
+			if (literal && (*literal < (DUMP_LITERAL_MAX - 1)))
+				(*literal)++;
+			else
+			{
+				literal	=	p++;
+				*literal	=	0;
+			}
+			*p++	=	c;
+		}
+		for (ii = 0; ii < run; ii++)
+			*crc	=	_crc16_update(*crc, c);
+		address	+=	run;
+		done	+=	run;
+	}
+	*outSize	=	p - out;
+	return done;
+}
+#endif //DUMP_RANGE
+
+//*	for watch dog timer startup
+//void (*app_start)(void) = 0x0000;
+
+	unsigned long flashSize = 0; //flash data size in bytes
+	unsigned long flashCounter = 0; //flash counter (readed / written bytes)
+	address_t flashAddressLast = 0; //last written flash address
+	int flashOperation = 0; //current flash operation (0-nothing, 1-write, 2-verify)
+
+/*
+ * message buffer, not on the stack (too large) and not cleared at startup
+ */
+static unsigned char	msgBuffer[MSG_BUFFER_SIZE] __attribute__ ((section (".noinit")));
+
+/*
+ * RAM layout, checked after link by 'make ramcheck':
+ * - .data and .bss are initialized by startup code before the WDRF copy below, they must end
+ *   below BOOT_INIT_RAM_END (0x400), application copy sources (boot_src_addr) must be above it
+ * - all buffers are in .noinit and are not touched before the copy, they must end below
+ *   the mailbox at RAMSIZE - 16
+ */
+#define RAMSIZE        0x2000
+#define boot_src_addr  (*((uint32_t*)(RAMSIZE - 16)))
+#define boot_dst_addr  (*((uint32_t*)(RAMSIZE - 12)))
+#define boot_copy_size (*((uint16_t*)(RAMSIZE - 8)))
+#define boot_reserved  (*((uint8_t*)(RAMSIZE - 6)))
+#define boot_app_flags (*((uint8_t*)(RAMSIZE - 5)))
+#define boot_app_magic (*((uint32_t*)(RAMSIZE - 4)))
+#define BOOT_APP_FLG_ERASE 0x01
+#define BOOT_APP_FLG_COPY  0x02
+#define BOOT_APP_FLG_FLASH 0x04
+#define BOOT_APP_FLG_RUN   0x08 //stay in bootloader and wait for host after watchdog reset
+
+#ifdef FAST_BOOT
+/*
+ * Boot policy, 2 bit action per reset cause (MCUSR bit PORF, EXTRF, BORF, WDRF),
+ * the lowest set MCUSR bit selects the action, JTAG reset or no reset waits for host
+ */
+#define BOOT_ACTION_APP		0	// start application (wait if there is none)
+#define BOOT_ACTION_WAIT	1	// wait for host
+#define BOOT_ACTION_COPY	2	// RAM mailbox copy, then start application
+#define BOOT_ACTION_DEFAULT	3	// EEPROM override: use build time action
+
+#define BOOT_POLICY_ENTRY(cause, action)	((action) << (2 * (cause)))
+
+/*
+ * external reset = DTR pulse from USB-serial converter or reset button
+ */
+#ifndef BOOT_POLICY
+	#define BOOT_POLICY		(BOOT_POLICY_ENTRY(PORF, BOOT_ACTION_APP) | BOOT_POLICY_ENTRY(EXTRF, BOOT_ACTION_WAIT) | \
+							 BOOT_POLICY_ENTRY(BORF, BOOT_ACTION_APP) | BOOT_POLICY_ENTRY(WDRF, BOOT_ACTION_COPY))
+#endif
+
+/*
+ * EEPROM override at BOOT_POLICY_EEPROM (settings.h), policy byte followed by its complement
+ * (erased EEPROM = no override), no override when the location is not configured
+ */
+#if defined(BOOT_POLICY_EEPROM) && ((BOOT_POLICY_EEPROM) + 1 > E2END)
+	#error "BOOT_POLICY_EEPROM outside of EEPROM"
+#endif
+#endif //FAST_BOOT
+	
+
+#ifdef LCD_HD44780
+//*****************************************************************************
+/*
+ * startup screen
+ */
+static void lcdSplash(void)
+{
+    lcd_goto(65);
+    lcd_puts("Original Prusa i3");
+    lcd_goto(23);
+    lcd_puts("Prusa Research");
+//    lcd_goto(90);
+//	lcd_puts("boot...    ...");
+    lcd_goto(101);
+	lcd_puts("...");
+	lcd_flush();
+}
+
+#ifdef LCD_HD44780_ASYNC_INIT
+static uint8_t	lcdInitDelay	=	0;	// != 0 ms until next init step
+static uint16_t	lcdInitStart;			// time of last init step
+
+//*****************************************************************************
+/*
+ * next LCD init step when its delay passed, shows startup screen when done
+ */
+static void lcdInitPoll(void)
+{
+	if (lcdInitDelay && timeElapsed(lcdInitStart, lcdInitDelay + 1))	// +1, tick may come right after start
+	{
+		lcdInitDelay	=	lcd_init_poll();
+		lcdInitStart	=	millis();
+		if (lcdInitDelay == 0)
+			lcdSplash();
+	}
+}
+#endif //LCD_HD44780_ASYNC_INIT
+
+#ifdef LCD_HD44780_COUNTER
+static uint8_t	progressOperation	=	0;	// flashOperation shown
+static uint8_t	progressPercent;			// percent shown
+static uint32_t	progressThreshold;			// 100 * flashCounter of next percent
+#ifdef LCD_HD44780_RATE
+static uint16_t	rateStart;					// time of speed measuring start
+static uint32_t	rateCounter;				// flashCounter at speed measuring start
+#endif
+
+//*****************************************************************************
+/*
+ * prints value right aligned in digits characters, leading positions are fill
+ */
+static void lcdPutNumber(uint16_t value, uint8_t digits, char fill)
+{
+	char	text[6];
+
+	text[digits]	=	0;
+	do
+	{
+		text[--digits]	=	'0' + (value % 10);
+		value			/=	10;
+	} while (digits && value);
+	while (digits)
+		text[--digits]	=	fill;
+	lcd_puts(text);
+}
+
+//*****************************************************************************
+/*
+ * upload progress, redrawn only when shown values change
+ * percent advances each time 100 * flashCounter passes next multiple of
+ * flashSize, no division per frame
+ */
+static void lcdProgress(void)
+{
+	uint32_t	scaled	=	flashCounter * 100;
+	uint8_t		redraw	=	0;
+
+	// new operation or counter restarted below shown percent
+	if ((progressOperation != flashOperation) || ((scaled + flashSize) < progressThreshold))
+	{
+		progressOperation	=	flashOperation;
+		progressPercent		=	0;
+		progressThreshold	=	flashSize;
+		lcd_goto(87);
+		lcd_puts((flashOperation == 1)?" write ":"verify ");
+		redraw	=	1;
+	#ifdef LCD_HD44780_RATE
+		rateStart	=	millis();
+		rateCounter	=	flashCounter;
+	#endif
+	}
+	while ((progressPercent < 100) && (scaled >= progressThreshold))
+	{
+		progressPercent++;
+		progressThreshold	+=	flashSize;
+		redraw	=	1;
+	}
+	if (redraw)
+	{
+		lcd_goto(94);
+		lcdPutNumber(progressPercent, 3, ' ');
+		lcd_putc('%');
+	}
+
+#ifdef LCD_HD44780_RATE
+	if (timeElapsed(rateStart, RATE_PERIOD_MS))
+	{
+		uint16_t	now		=	millis();
+		uint32_t	rate	=	((flashCounter - rateCounter) * 1000) / (uint16_t)(now - rateStart);	// bytes/s
+
+		rateStart	=	now;
+		rateCounter	=	flashCounter;
+		lcd_goto(65);
+		lcdPutNumber(rate >> 10, 3, ' ');
+		lcd_putc('.');
+		lcdPutNumber(((rate & 1023) * 10) >> 10, 1, '0');
+		lcd_puts("KB/s ETA ");
+		if (rate && (flashCounter < flashSize))
+		{
+			uint32_t	eta	=	(flashSize - flashCounter + rate - 1) / rate;	// seconds
 
-void blinkBootLed(int state)
-{
-    if (state == 1)
-        PORTB = 0b10000000;
-    else
-        PORTB = 0b00000000;
+			if (eta > 5999)
+				eta	=	5999;
+			lcdPutNumber(eta / 60, 2, ' ');
+			lcd_putc(':');
+			lcdPutNumber(eta % 60, 2, '0');
+		}
+		else
+			lcd_puts("--:--");
+	}
+#endif //LCD_HD44780_RATE
 }
+#endif //LCD_HD44780_COUNTER
+#endif //LCD_HD44780
 
-//Heaters off (PG5=0, PE5=0)
-//Fans on (PH5=1, PH3=1)
-//Motors off (PA4..7=1)
-void pinsToDefaultState()
-{
+#ifdef FAST_BOOT
+//*****************************************************************************
 /*
-    DDRG = 0b00001000;
-    DDRE = 0b00001000;
-    DDRH = 0b00101000;
-    DDRA = 0b00011110;
-    DDRB = 0b10000000;
-    PORTH = 0b00101000;
-    PORTG = 0b00000000;
-    PORTE = 0b00000000;
-    PORTA = 0b00000000;*/ //original code
-	DDRA |= 0b11110000; //PA4..7 out
-	PORTA |= 0b11110000; //PA4..7 = 1
-	DDRE |= 0b00100000; //PE5 out
-	PORTE &= 0b11011111; //PE5 = 0
-	DDRG |= 0b00100000; //PG5 out
-	PORTG &= 0b11011111; //PG5 = 0
-	DDRH |= 0b00101000; //PH5, PH3 out
-	PORTH |= 0b00101000; //PH5, PH3 = 1
-}
-
-#endif //EINSYBOARD
-
-//*	for watch dog timer startup
-//void (*app_start)(void) = 0x0000;
+ * boot action for reset cause, EEPROM policy overrides BOOT_POLICY
+ */
+static uint8_t bootPolicy(uint8_t resetCause)
+{
+#ifdef BOOT_POLICY_EEPROM
+	uint8_t	policy	=	eeprom_read_byte((uint8_t *)(BOOT_POLICY_EEPROM));
+#else
+	uint8_t	policy	=	0xff;				// build time policy
+#endif
+	uint8_t	ii;
 
-	unsigned long flashSize = 0; //flash data size in bytes
-	unsigned long flashCounter = 0; //flash counter (readed / written bytes)
-	address_t flashAddressLast = 0; //last written flash address
-	int flashOperation = 0; //current flash operation (0-nothing, 1-write, 2-verify)
+#ifdef BOOT_POLICY_EEPROM
+	if (eeprom_read_byte((uint8_t *)((BOOT_POLICY_EEPROM) + 1)) != (uint8_t)~policy)
+		policy	=	0xff;						// no valid override, build time policy
+#endif
+	for (ii = PORF; ii <= WDRF; ii++)
+	{
+		if (resetCause & _BV(ii))
+		{
+			uint8_t	action	=	(policy >> (2 * ii)) & 3;
 
-#define RAMSIZE        0x2000
-#define boot_src_addr  (*((uint32_t*)(RAMSIZE - 16)))
-#define boot_dst_addr  (*((uint32_t*)(RAMSIZE - 12)))
-#define boot_copy_size (*((uint16_t*)(RAMSIZE - 8)))
-#define boot_reserved  (*((uint8_t*)(RAMSIZE - 6)))
-#define boot_app_flags (*((uint8_t*)(RAMSIZE - 5)))
-#define boot_app_magic (*((uint32_t*)(RAMSIZE - 4)))
-#define BOOT_APP_FLG_ERASE 0x01
-#define BOOT_APP_FLG_COPY  0x02
-#define BOOT_APP_FLG_FLASH 0x04
-	
+			if (action == BOOT_ACTION_DEFAULT)
+				action	=	(BOOT_POLICY >> (2 * ii)) & 3;
+			return action;
+		}
+	}
+	return BOOT_ACTION_WAIT;					// JTAG reset or jump from application
+}
+#endif //FAST_BOOT
 
 //*****************************************************************************
 int main(void)
 {
 	address_t		address			=	0;
-	address_t		eraseAddress	=	0;
 	unsigned char	msgParseState;
 	unsigned int	ii				=	0;
 	unsigned char	checksum		=	0;
 	unsigned char	seqNum			=	0;
 	unsigned int	msgLength		=	0;
-	unsigned char	msgBuffer[285];
-	unsigned char	c, *p;
+	unsigned char	c;
 	unsigned char   isLeave = 0;
+#ifdef BAUD_SWITCH
+	uint16_t		baudDivisor		=	0;	// != 0 baudrate switch after answer
+#endif
+#ifdef SPM_ZERO_COPY
+	unsigned char	*ingest			=	0;	// page buffer receiving data of current frame
+#endif
+#ifdef PIPELINE_WINDOW
+	unsigned char	windowSize		=	0;	// 0 = stop-and-wait
+	unsigned char	windowSeqNum	=	0;	// sequence number of next frame to process
+	unsigned char	windowError		=	0;	// ANSWER_CKSUM_ERROR sent, waiting for frame windowSeqNum
+#endif
 
+#ifndef TIMER_CLOCK
 	unsigned long	boot_timeout;
 	unsigned long	boot_timer;
+#endif
 	unsigned int	boot_state;
 
 	//*	some chips dont set the stack properly
@@ -773,8 +2366,28 @@ int main(void)
 	WDTCSR	|=	_BV(WDCE) | _BV(WDE);
 	WDTCSR	=	0;
 	__asm__ __volatile__ ("sei");
+#ifdef FAST_BOOT
+	uint8_t	bootAction	=	bootPolicy(mcuStatusReg);
+
+	if ((mcuStatusReg & _BV(WDRF)) && (boot_app_magic == 0x55aa55aa) && (boot_app_flags & BOOT_APP_FLG_RUN))
+	{
+		boot_app_magic	=	0;				// request handled, next reset starts application
+		bootAction		=	BOOT_ACTION_WAIT;
+	}
+	if (bootAction == BOOT_ACTION_APP)
+	{
+	#if (FLASHEND > 0x10000)
+		if (pgm_read_word_far(0) != 0xffff)	// valid application, start it without waiting
+	#else
+		if (pgm_read_word_near(0) != 0xffff)
+	#endif
+			goto exit;
+	}
+	if (bootAction == BOOT_ACTION_COPY)
+#else
 	// check if WDT generated the reset, if so, go straight to app
 	if (mcuStatusReg & _BV(WDRF))
+#endif //FAST_BOOT
 	{
 		if (boot_app_magic == 0x55aa55aa)
 		{
@@ -833,9 +2446,11 @@ int main(void)
 #endif
 
 
-	boot_timer	=	0;
 	boot_state	=	0;
+	erasedPagesClear();
 
+#ifndef TIMER_CLOCK
+	boot_timer	=	0;
 #ifdef BLINK_LED_WHILE_WAITING
 //	boot_timeout	=	 90000;		//*	should be about 4 seconds
 //	boot_timeout	=	170000;
@@ -843,6 +2458,7 @@ int main(void)
 #else
 	boot_timeout	=	3500000; // 7 seconds , approx 2us per step when optimize "s"
 #endif
+#endif //TIMER_CLOCK
 	/*
 	 * Branch to bootloader or application code ?
 	 */
@@ -880,11 +2496,19 @@ int main(void)
 #ifdef DUALSERIAL
     initUart();
 #endif //DUALSERIAL
+#ifdef TIMER_CLOCK
+	timerInit();
+#endif
 
 #ifdef LCD_HD44780
+#ifdef LCD_HD44780_ASYNC_INIT
+	lcdInitDelay	=	lcd_init_begin();	// splash is shown when init is done
+	lcdInitStart	=	millis();
+#else
     lcd_init();
     lcd_clrscr();
     lcd_goto(0);
+#endif
 /*	if (boot_app_magic == 0x55aa55aa)
 	{
 		lcd_print_hex_dword(boot_src_addr);
@@ -904,15 +2528,9 @@ int main(void)
     lcd_puts("Original Prusa i3");
     lcd_goto(47);
     lcd_puts("Prusa Research");*/
-    lcd_goto(65);
-    lcd_puts("Original Prusa i3");
-    lcd_goto(23);
-    lcd_puts("Prusa Research");
-//    lcd_goto(90);
-//	lcd_puts("boot...    ...");
-    lcd_goto(101);
-	lcd_puts("...");
-
+#ifndef LCD_HD44780_ASYNC_INIT
+    lcdSplash();
+#endif
 #endif //LCD_HD44780
 
 
@@ -924,6 +2542,34 @@ int main(void)
     uint16_t animationFrame = 0;
 
 
+#ifdef TIMER_CLOCK
+	{
+		uint16_t	bootStart	=	millis();
+		uint16_t	blinkStart	=	bootStart;
+
+		while ((!(Serial_Available(0))) && (!(Serial_Available(2))) && (boot_state == 0))		// wait for data
+		{
+		#ifdef LCD_HD44780_ASYNC_INIT
+			lcdInitPoll();
+		#endif
+			if (timeElapsed(bootStart, BOOT_WINDOW_MS))
+			{
+				boot_state	=	1; // (after ++ -> boot_state=2 bootloader timeout, jump to main 0x00000 )
+			}
+		#ifdef BLINK_LED_WHILE_WAITING
+			if (timeElapsed(blinkStart, BLINK_PERIOD_MS))
+			{
+				blinkStart		+=	BLINK_PERIOD_MS;
+				//*	toggle the LED
+				PROGLED_TOGGLE();	// turn LED ON
+			}
+		#endif
+		}
+		if (Serial_Available(2))
+			selectedSerial = 2;
+		boot_state++; // ( if boot_state=1 bootloader received byte from UART, enter bootloader mode)
+	}
+#else //TIMER_CLOCK
 	while (boot_state==0)
 	{
 #ifdef DUALSERIAL
@@ -939,7 +2585,7 @@ int main(void)
 			if ((boot_timer % _BLINK_LOOP_COUNT_) == 0)
 			{
 				//*	toggle the LED
-				PROGLED_PORT	^=	(1<<PROGLED_PIN);	// turn LED ON
+				PROGLED_TOGGLE();	// turn LED ON
 			}
 		#endif
 		}
@@ -958,18 +2604,23 @@ int main(void)
 			if ((boot_timer % _BLINK_LOOP_COUNT_) == 0)
 			{
 				//*	toggle the LED
-				PROGLED_PORT	^=	(1<<PROGLED_PIN);	// turn LED ON
+				PROGLED_TOGGLE();	// turn LED ON
 			}
 		#endif
 		}
 #endif //DUALSERIAL
 		boot_state++; // ( if boot_state=1 bootloader received byte from UART, enter bootloader mode)
 	}
+#endif //TIMER_CLOCK
 
     int messageShown = 0;
 
 	if (boot_state==1)
 	{
+	#ifdef LCD_HD44780_ASYNC_INIT
+		while (lcdInitDelay)
+			lcdInitPoll();				// host came before LCD was ready
+	#endif
 		//*	main loop
 		while (!isLeave)
 		{
@@ -982,7 +2633,11 @@ int main(void)
 				if (boot_state==1)
 				{
 					boot_state	=	0;
+				#ifdef SERIAL_RX_BUFFER
+					c			=	recchar_timeout();	// first byte is already in the ring buffer
+				#else
 					c			=	UART_DATA_REG;
+				#endif
 				}
 				else
 				{
@@ -1034,21 +2689,55 @@ int main(void)
 						break;
 
 					case ST_GET_TOKEN:
-						if ( c == TOKEN )
+						if ( (c == TOKEN) && msgLength && (msgLength <= sizeof(msgBuffer))
+						#ifdef PIPELINE_WINDOW
+							&& (!windowSize || (msgLength <= PIPELINE_MSG_MAX))	// frames in flight fit to receive buffer
+						#endif
+							)
 						{
 							msgParseState	=	ST_GET_DATA;
 							checksum		^=	c;
 							ii				=	0;
+						#ifdef SPM_ZERO_COPY
+							ingest			=	0;
+						#endif
 						}
 						else
 						{
+						#ifdef PIPELINE_WINDOW
+							if (windowSize && !windowError)
+								msgParseState	=	ST_WINDOW_ERROR;	// frame can not be parsed
+							else
+						#endif
 							msgParseState	=	ST_START;
 						}
 						break;
 
 					case ST_GET_DATA:
+					#ifdef SPM_ZERO_COPY
+						if (ingest)
+						{
+							ingest[ii - 10]	=	c;	// data after 10 byte header
+							ii++;
+						}
+						else
+					#endif
 						msgBuffer[ii++]	=	c;
 						checksum		^=	c;
+					#ifdef SPM_ZERO_COPY
+						if ((ii == 10) && (msgBuffer[0] == CMD_PROGRAM_FLASH_ISP))
+						{
+							unsigned int	size	=	((msgBuffer[1])<<8) | msgBuffer[2];
+
+							// one page frame, page is queued only when checksum matches
+							if (size && ((size + 10) == msgLength) && (size <= (SPM_PAGESIZE - (address & (SPM_PAGESIZE - 1))))
+							#ifdef LZ_UPLOAD
+								&& !lzActive		// page buffer holds partial page of LZ stream
+							#endif
+								)
+								ingest	=	spmPageBuffer();
+						}
+					#endif
 						if (ii == msgLength )
 						{
 							msgParseState	=	ST_GET_CHECK;
@@ -1058,16 +2747,51 @@ int main(void)
 					case ST_GET_CHECK:
 						if ( c == checksum )
 						{
+						#ifdef PIPELINE_WINDOW
+							if (windowSize && (seqNum != windowSeqNum))
+							{
+								// frame ahead of the expected one, the expected one was lost;
+								// older frames are sent again by host after an error answer
+								if (!windowError && ((unsigned char)(seqNum - windowSeqNum) < 0x80))
+									msgParseState	=	ST_WINDOW_ERROR;
+								// frame behind the expected one, already processed but its answer was lost,
+								// host is told to continue with windowSeqNum
+								else if ((unsigned char)(seqNum - windowSeqNum) >= 0x80)
+									msgParseState	=	ST_WINDOW_ERROR;
+								else
+									msgParseState	=	ST_START;	// frame sent after a broken one, host sends it again
+							}
+							else
+						#endif
 							msgParseState	=	ST_PROCESS;
 						}
 						else
 						{
+						#ifdef PIPELINE_WINDOW
+							if (windowSize && ((seqNum == windowSeqNum) || !windowError))
+								msgParseState	=	ST_WINDOW_ERROR;	// sequence number may be broken too
+							else
+						#endif
 							msgParseState	=	ST_START;
 						}
 						break;
 				}	//	switch
+
+			#ifdef PIPELINE_WINDOW
+				if (msgParseState == ST_WINDOW_ERROR)
+				{
+					seqNum			=	windowSeqNum;			// tell host which frame to send again
+					msgBuffer[0]	=	ANSWER_CKSUM_ERROR;
+					windowError		=	1;
+					msgParseState	=	ST_PROCESS;
+				}
+			#endif
 			}	//	while(msgParseState)
 
+		#ifdef BAUD_SWITCH
+			baudFallbackCount	=	0;		// valid frame received, keep baudrate
+		#endif
+
 #ifdef LCD_HD44780
             if (messageShown == 0)
 			{
@@ -1099,35 +2823,19 @@ int main(void)
 
 #ifdef LCD_HD44780_COUNTER
 			if ((flashSize != 0) && flashOperation)
-			{
-				if (flashOperation == 1) //write
-				{
-					lcd_goto(88);
-					lcd_puts("write ");
-				}
-				if (flashOperation == 2) //verify
-				{
-					lcd_goto(87);
-					lcd_puts("verify ");
-				}
-				int progress = 100 * flashCounter / flashSize;
-				char text[4] = "   ";
-				for (int i = 2; i >= 0; i--)
-					if (progress > 0)
-					{
-						text[i] = '0' + (progress % 10);
-						progress /= 10;
-					}
-					else
-						text[i] = ' ';
-				lcd_puts(text);
-				lcd_putc('%');
-			}
+				lcdProgress();
 #endif //LCD_HD44780_COUNTER
+#ifdef LCD_HD44780
+			lcd_flush();					// send only changed characters
+#endif
 
 			/*
 			 * Now process the STK500 commands, see Atmel Appnote AVR068
 			 */
+		#ifdef SPM_ASYNC
+			if ((msgBuffer[0] != CMD_PROGRAM_FLASH_ISP) && (msgBuffer[0] != CMD_PROGRAM_FLASH_LZ_PRUSA3D))
+				spmSync();			// other commands read flash/fuses or leave, finish programming first
+		#endif
 
 			switch (msgBuffer[0])
 			{
@@ -1226,6 +2934,22 @@ int main(void)
 						case PARAM_SW_MINOR:
 							value	=	CONFIG_PARAM_SW_MINOR;
 							break;
+					#ifdef SPM_SKIP_EQUAL
+						case PARAM_SKIPPED_PAGES_LOW_PRUSA3D:
+							value	=	spmSkippedPages & 0xff;
+							break;
+						case PARAM_SKIPPED_PAGES_HIGH_PRUSA3D:
+							value	=	spmSkippedPages >> 8;
+							break;
+					#endif
+					#ifdef SPM_SKIP_ERASE
+						case PARAM_SKIPPED_ERASES_LOW_PRUSA3D:
+							value	=	spmSkippedErases & 0xff;
+							break;
+						case PARAM_SKIPPED_ERASES_HIGH_PRUSA3D:
+							value	=	spmSkippedErases >> 8;
+							break;
+					#endif
 						default:
 							value	=	0;
 							break;
@@ -1300,7 +3024,10 @@ int main(void)
 						unsigned char lockBits	=	msgBuffer[4];
 
 						lockBits	=	(~lockBits) & 0x3C;	// mask BLBxx bits
+						spmEepromSync();
+						cli();
 						boot_lock_bits_set(lockBits);		// and program it
+						sei();
 						boot_spm_busy_wait();
 
 						msgLength		=	3;
@@ -1310,7 +3037,10 @@ int main(void)
 					break;
 	#endif
 				case CMD_CHIP_ERASE_ISP:
-					eraseAddress	=	0;
+					erasedPagesClear();
+				#ifdef LZ_UPLOAD
+					lzActive	=	0;
+				#endif
 					msgLength		=	2;
 				//	msgBuffer[1]	=	STATUS_CMD_OK;
 					msgBuffer[1]	=	STATUS_CMD_FAILED;	//*	isue 543, return FAILED instead of OK
@@ -1335,18 +3065,204 @@ int main(void)
 					msgBuffer[1]	=	STATUS_CMD_OK;
 					break;
 
+			#ifdef BAUD_SWITCH
+				case CMD_SET_BAUD_PRUSA3D:
+					{
+						uint32_t	baud	=	((uint32_t)msgBuffer[1]<<24)|((uint32_t)msgBuffer[2]<<16)|((uint16_t)msgBuffer[3]<<8)|(msgBuffer[4]);
+
+						msgLength		=	2;
+						msgBuffer[1]	=	STATUS_CMD_FAILED;
+						// only baudrates without error in double speed mode (500k, 1M at 16MHz)
+						if (baud && (((F_CPU / 8) % baud) == 0) && ((F_CPU / 8 / baud) <= 4096))
+						{
+							baudDivisor		=	F_CPU / 8 / baud;		// UBRR + 1
+							msgBuffer[1]	=	STATUS_CMD_OK;
+						}
+					}
+					break;
+			#endif
+
+			#ifdef LZ_UPLOAD
+				case CMD_PROGRAM_FLASH_LZ_PRUSA3D:
+					{
+						unsigned int	size	=	((msgBuffer[1])<<8) | msgBuffer[2];
+
+						if (((size + 4) != msgLength) ||	// size does not match received data
+							((msgBuffer[3] & LZ_FLAG_FIRST) && ((address & (SPM_PAGESIZE - 1)) || (address >= APP_END))) ||	// stream starts at a page of application section
+							(!(msgBuffer[3] & LZ_FLAG_FIRST) && !lzActive))	// no stream to continue
+						{
+							msgLength		=	2;
+							msgBuffer[1]	=	STATUS_CMD_FAILED;
+							break;
+						}
+
+						if (msgBuffer[3] & LZ_FLAG_FIRST)
+						{
+							lzActive	=	1;
+							lzState		=	LZ_STATE_FLAGS;
+							lzAddress	=	address;
+							lzPageFill	=	0;
+							lzWindowPos	=	0;
+							for (ii = 0; ii < sizeof(lzWindow); ii++)
+								lzWindow[ii]	=	0;		// matches before stream start read zeros
+							if ((flashSize != 0) && (address == 0))
+							{
+								flashCounter	=	0;
+								flashOperation	=	1; //write
+							}
+						}
+						lzCount	=	0;
+						lzDecode(msgBuffer + 4, size);
+						if ((msgBuffer[3] & LZ_FLAG_LAST) && (lzPageFill & 1))
+							lzPut(0xff);					// pad to whole word
+						if ((msgBuffer[3] & LZ_FLAG_LAST) && lzPageFill)
+						{
+							spmPageCommit(lzAddress, lzPageFill);
+							lzAddress	+=	lzPageFill;
+							lzPageFill	=	0;
+						}
+						if (msgBuffer[3] & LZ_FLAG_LAST)
+							lzActive	=	0;				// lzAddress may be unaligned now, next stream needs LZ_FLAG_FIRST
+						address			=	lzAddress + lzPageFill;
+						flashCounter	+=	lzCount;	// progress counts decompressed bytes
+						msgLength		=	4;
+						msgBuffer[1]	=	(address > APP_END) ? STATUS_CMD_FAILED : STATUS_CMD_OK;	// pages above are not written
+						msgBuffer[2]	=	lzCount >> 8;
+						msgBuffer[3]	=	lzCount & 0xff;
+					}
+					break;
+			#endif
+
+			#ifdef PAGE_CRC
+				case CMD_READ_PAGE_CRC_PRUSA3D:
+					{
+						unsigned int	page	=	((msgBuffer[1])<<8) | msgBuffer[2];
+						unsigned int	count	=	((msgBuffer[3])<<8) | msgBuffer[4];
+						unsigned char	*p		=	msgBuffer+2;
+
+						if (count > ((sizeof(msgBuffer) - 3) / 2))
+							count	=	(sizeof(msgBuffer) - 3) / 2;	// as many pages as fit to one answer
+						if (page > (APP_END / SPM_PAGESIZE))
+							page	=	APP_END / SPM_PAGESIZE;
+						if (count > ((APP_END / SPM_PAGESIZE) - page))
+							count	=	(APP_END / SPM_PAGESIZE) - page;	// application section only
+						msgLength		=	3 + 2 * count;
+						msgBuffer[1]	=	STATUS_CMD_OK;
+						while (count--)
+						{
+							uint16_t	crc	=	pageCrc((address_t)page++ * SPM_PAGESIZE);
+							*p++	=	crc >> 8;
+							*p++	=	crc & 0xff;
+						}
+						*p++	=	STATUS_CMD_OK;
+					}
+					break;
+			#endif
+
+			#ifdef VERIFY_CRC32
+				case CMD_VERIFY_CRC32_PRUSA3D:
+					{
+						uint32_t	start		=	((uint32_t)msgBuffer[1]<<24)|((uint32_t)msgBuffer[2]<<16)|((uint16_t)msgBuffer[3]<<8)|(msgBuffer[4]);
+						uint32_t	size		=	((uint32_t)msgBuffer[5]<<24)|((uint32_t)msgBuffer[6]<<16)|((uint16_t)msgBuffer[7]<<8)|(msgBuffer[8]);
+						uint32_t	expected	=	((uint32_t)msgBuffer[9]<<24)|((uint32_t)msgBuffer[10]<<16)|((uint16_t)msgBuffer[11]<<8)|(msgBuffer[12]);
+						uint32_t	crc;
+
+						if ((start > FLASHEND) || (size > (FLASHEND + 1 - start)))
+						{
+							msgLength		=	2;
+							msgBuffer[1]	=	STATUS_CMD_FAILED;
+							break;
+						}
+						if (flashSize != 0)
+						{
+							flashOperation	=	2; //verify
+							flashCounter	=	size;
+						}
+						crc				=	flashCrc32(start, size);
+						msgLength		=	6;
+						msgBuffer[1]	=	(crc == expected) ? STATUS_CMD_OK : STATUS_CMD_FAILED;
+						msgBuffer[2]	=	crc >> 24;
+						msgBuffer[3]	=	crc >> 16;
+						msgBuffer[4]	=	crc >> 8;
+						msgBuffer[5]	=	crc & 0xff;
+					}
+					break;
+			#endif
+
+			#ifdef DUMP_RANGE
+				case CMD_DUMP_PRUSA3D:
+					{
+						unsigned char	memory	=	msgBuffer[1];
+						uint32_t		start	=	((uint32_t)msgBuffer[2]<<24)|((uint32_t)msgBuffer[3]<<16)|((uint16_t)msgBuffer[4]<<8)|(msgBuffer[5]);
+						uint32_t		size	=	((uint32_t)msgBuffer[6]<<24)|((uint32_t)msgBuffer[7]<<16)|((uint16_t)msgBuffer[8]<<8)|(msgBuffer[9]);
+						uint32_t		end		=	(memory == DUMP_MEMORY_EEPROM) ? ((uint32_t)E2END + 1) : ((uint32_t)FLASHEND + 1);
+						uint16_t		crc		=	0xffff;
+
+						if ((memory > DUMP_MEMORY_EEPROM) || (size == 0) || (start >= end) || (size > (end - start)))
+						{
+							msgLength		=	2;
+							msgBuffer[1]	=	STATUS_CMD_FAILED;
+							break;
+						}
+						/*
+						 * answer frames [cmd, status, flags, count hi, count lo, RLE data, crc hi, crc lo],
+						 * count = dumped bytes in frame, crc = CRC-16 of all bytes dumped so far
+						 */
+						do {
+							unsigned int	length	=	sizeof(msgBuffer) - 7;
+							unsigned int	count	=	dumpEncode(memory, start, size, msgBuffer + 5, &length, &crc);
+
+							start			+=	count;
+							size			-=	count;
+							msgBuffer[1]	=	STATUS_CMD_OK;
+							msgBuffer[2]	=	size ? 0 : DUMP_FLAG_LAST;
+							msgBuffer[3]	=	count >> 8;
+							msgBuffer[4]	=	count & 0xff;
+							msgBuffer[5 + length]	=	crc >> 8;
+							msgBuffer[6 + length]	=	crc & 0xff;
+							msgLength		=	length + 7;
+							checksum		=	sendBytes(msgBuffer, msgLength, sendHeader(seqNum, msgLength));
+							sendchar(checksum);
+						} while (size);
+						msgLength	=	0;							// answer already sent
+						break;
+					}
+			#endif
+
+			#ifdef PIPELINE_WINDOW
+				case CMD_SET_WINDOW_PRUSA3D:
+					windowSize		=	msgBuffer[1];	// 0 = back to stop-and-wait
+					if (windowSize > PIPELINE_WINDOW_MAX)
+						windowSize	=	PIPELINE_WINDOW_MAX;
+					msgLength		=	3;
+					msgBuffer[1]	=	STATUS_CMD_OK;
+					msgBuffer[2]	=	windowSize;
+					break;
+
+				case ANSWER_CKSUM_ERROR:
+					msgLength		=	2;
+					msgBuffer[1]	=	STATUS_CKSUM_ERROR;
+					break;
+			#endif
+
 				case CMD_PROGRAM_FLASH_ISP:
 				case CMD_PROGRAM_EEPROM_ISP:
 					{
 						unsigned int	size	=	((msgBuffer[1])<<8) | msgBuffer[2];
 						unsigned char	*p	=	msgBuffer+10;
+					#ifndef SPM_ASYNC
 						unsigned int	data;
 						unsigned char	highByte, lowByte;
 						address_t		tempaddress	=	address;
+						address_t		eraseAddress;
+					#endif
 
 
 						if ( msgBuffer[0] == CMD_PROGRAM_FLASH_ISP )
 						{
+						#ifdef LZ_UPLOAD
+							lzActive	=	0;		// open LZ stream is aborted, its partial page buffer is reused
+						#endif
 							if (flashSize != 0)
 							{
 								if (address == 0) //first page
@@ -1360,31 +3276,81 @@ int main(void)
 								flashAddressLast = address;
 							}
 
-							// erase only main section (bootloader protection)
-							if (eraseAddress < APP_END ) //erase and write only blocks with address less 0x3e000
-							{ //because prevent "brick"
-									boot_page_erase(eraseAddress);	// Perform page erase
-									boot_spm_busy_wait();		// Wait until the memory is erased.
-									eraseAddress += SPM_PAGESIZE;	// point to next page to be erase
+						#ifdef SPM_ASYNC
+						#ifdef SPM_ZERO_COPY
+							if (ingest)
+							{
+								spmPageCommit(address, size);	// data already in page buffer
+								address	+=	size;
+								size	=	0;
 							}
-							if (address < APP_END)
+						#endif
+							while (size)
 							{
-								/* Write FLASH */
-								do {
-									lowByte		=	*p++;
-									highByte 	=	*p++;
-
-									data		=	(highByte << 8) | lowByte;
-									boot_page_fill(address,data);
-
-									address	=	address + 2;	// Select next word in memory
-									size	-=	2;				// Reduce number of bytes to write by two
-								} while (size);					// Loop until all bytes written
-
-								boot_page_write(tempaddress);
-								boot_spm_busy_wait();
-								boot_rww_enable();				// Re-enable the RWW section
+								unsigned char	*d		=	spmPageBuffer();
+								unsigned int	chunk	=	SPM_PAGESIZE - (address & (SPM_PAGESIZE - 1));
+								unsigned int	ii;
+
+								if (chunk > size)
+									chunk	=	size;					// up to end of page
+								for (ii = 0; ii < chunk; ii++)
+									d[ii]	=	*p++;
+								spmPageCommit(address, chunk);	// answer before page is programmed
+								address	+=	chunk;
+								size	-=	chunk;
+							}
+						#else
+							while (size)
+							{
+								unsigned int	chunk	=	SPM_PAGESIZE - (address & (SPM_PAGESIZE - 1));
+
+								if (chunk > size)
+									chunk	=	size;					// up to end of page
+								size			-=	chunk;
+								tempaddress		=	address;
+								spmEepromSync();
+								// erase only main section (bootloader protection)
+								eraseAddress	=	erasePage(address);
+								if ((eraseAddress == APP_END) && (address < APP_END))
+									eraseAddress	=	erasePageAgain(address, p, chunk);	// page written before in this session
+								if (eraseAddress < APP_END)
+								{
+										cli();
+										boot_page_erase(eraseAddress);	// Perform page erase
+										sei();
+										boot_spm_busy_wait();		// Wait until the memory is erased (RX interrupt keeps receiving)
+								}
+								if (address < APP_END)
+								{
+									/* Write FLASH */
+									do {
+										lowByte		=	*p++;
+										highByte 	=	*p++;
+
+										data		=	(highByte << 8) | lowByte;
+										cli();
+										boot_page_fill(address,data);
+										sei();
+
+										address	=	address + 2;	// Select next word in memory
+										chunk	-=	2;				// Reduce number of bytes to write by two
+									} while (chunk);				// Loop until page written
+
+									cli();
+									boot_page_write(tempaddress);
+									sei();
+									boot_spm_busy_wait();
+									cli();
+									boot_rww_enable();				// Re-enable the RWW section
+									sei();
+								}
+								else
+								{
+									address	+=	chunk;
+									p		+=	chunk;
+								}
 							}
+						#endif //SPM_ASYNC
 						}
 						else
 						{
@@ -1392,7 +3358,13 @@ int main(void)
 							uint16_t ii = address >> 1;
 							/* write EEPROM */
 							while (size) {
+							#if defined(EEPROM_QUEUE)
+								eepromQueueWrite(ii, *p++);		// answer before byte is written
+							#elif defined(EEPROM_SPLIT_WRITE)
+								eepromWriteByte(ii, *p++);
+							#else
 								eeprom_write_byte((uint8_t*)ii, *p++);
+							#endif
 								address+=2;						// Select next EEPROM byte
 								ii++;
 								size--;
@@ -1411,6 +3383,16 @@ int main(void)
 						unsigned char	*p		=	msgBuffer+1;
 						msgLength				=	size+3;
 
+					#ifdef STREAM_READ
+						if ((size == 0) || (size > 0xfffc) || ((msgBuffer[0] != CMD_READ_FLASH_ISP) && (msgLength > sizeof(msgBuffer))))
+					#else
+						if ((size == 0) || (msgLength > sizeof(msgBuffer)))
+					#endif
+						{
+							msgLength		=	2;
+							msgBuffer[1]	=	STATUS_CMD_FAILED;	// answer does not fit to buffer
+							break;
+						}
 						*p++	=	STATUS_CMD_OK;
 						if (msgBuffer[0] == CMD_READ_FLASH_ISP )
 						{
@@ -1425,6 +3407,20 @@ int main(void)
 									flashCounter += size; //add size to counter
 							}
 
+						#ifdef STREAM_READ
+							{
+								unsigned char	status	=	STATUS_CMD_OK;
+
+								checksum	=	sendHeader(seqNum, msgLength);
+								checksum	=	sendBytes(msgBuffer, 2, checksum);	// command, status
+								checksum	=	sendFlash(address, size, checksum);
+								checksum	=	sendBytes(&status, 1, checksum);
+								sendchar(checksum);
+								address		+=	size;
+								msgLength	=	0;					// answer already sent
+								break;
+							}
+						#endif //STREAM_READ
 							unsigned int data;
 
 							// Read FLASH
@@ -1445,11 +3441,16 @@ int main(void)
 						{
 							/* Read EEPROM */
 							do {
+							#ifdef EEPROM_QUEUE
+								*p++	=	eepromRead(address);	// queued value or EEPROM
+								address++;
+							#else
 								EEARL	=	address;			// Setup EEPROM address
 								EEARH	=	((address >> 8));
 								address++;					// Select next EEPROM byte
 								EECR	|=	(1<<EERE);			// Read EEPROM
 								*p++	=	EEDR;				// Send EEPROM data
+							#endif
 								size--;
 							} while (size);
 						}
@@ -1466,37 +3467,37 @@ int main(void)
 			/*
 			 * Now send answer message back
 			 */
-			sendchar(MESSAGE_START);
-			checksum	=	MESSAGE_START^0;
-
-			sendchar(seqNum);
-			checksum	^=	seqNum;
-
-			c			=	((msgLength>>8)&0xFF);
-			sendchar(c);
-			checksum	^=	c;
-
-			c			=	msgLength&0x00FF;
-			sendchar(c);
-			checksum ^= c;
-
-			sendchar(TOKEN);
-			checksum ^= TOKEN;
-
-			p	=	msgBuffer;
-			while ( msgLength )
+		#ifdef STREAM_READ
+			if (msgLength)						// 0 = answer already streamed
+		#endif
 			{
-				c	=	*p++;
-				sendchar(c);
-				checksum ^=c;
-				msgLength--;
+				checksum	=	sendBytes(msgBuffer, msgLength, sendHeader(seqNum, msgLength));
+				sendchar(checksum);
 			}
-			sendchar(checksum);
+		#ifdef PIPELINE_WINDOW
+			if (msgBuffer[0] != ANSWER_CKSUM_ERROR)
+			{
+				windowSeqNum	=	seqNum + 1;		// frames are processed in order
+				windowError		=	0;
+			}
+		#endif
 			seqNum++;
+
+		#ifdef BAUD_SWITCH
+			if (baudDivisor)
+			{
+				setBaudDivisor(baudDivisor - 1);	// answer was sent with old baudrate
+				baudDivisor			=	0;
+				baudFallbackCount	=	BAUD_FALLBACK_COUNT;
+			#ifdef TIMER_CLOCK
+				baudFallbackStart	=	millis();
+			#endif
+			}
+		#endif
 	
 		#ifndef REMOVE_BOOTLOADER_LED
 			//*	<MLS>	toggle the LED
-			PROGLED_PORT	^=	(1<<PROGLED_PIN);	// active high LED ON
+			PROGLED_TOGGLE();	// active high LED ON
 		#endif
 
 		}
@@ -1505,6 +3506,9 @@ int main(void)
 
 
 
+#ifdef LCD_HD44780
+	lcd_sync();							// LCD interrupt must not write PROGLED_PORT below
+#endif
 #ifndef REMOVE_BOOTLOADER_LED
 	PROGLED_DDR		&=	~(1<<PROGLED_PIN);	// set to default
 	PROGLED_PORT	&=	~(1<<PROGLED_PIN);	// active low LED OFF
@@ -1515,11 +3519,20 @@ int main(void)
 exit:
 	asm volatile ("nop");			// wait until port has changed
 
+	sendflush();					// last answer must leave before the application reinitializes UART
+
 	/*
 	 * Now leave bootloader
 	 */
 
 	UART_STATUS_REG	&=	0xfd;
+#ifdef SERIAL_RX_BUFFER
+	releaseInterrupts();
+#elif defined(EEPROM_SPLIT_WRITE)
+	eepromRelease();
+#else
+	spmEepromSync();
+#endif
 	boot_rww_enable();				// enable application section
 
 